@@ -0,0 +1,231 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Needed for CPU sets and pthread_setaffinity_np
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include "affinity.h"
+
+// Parses a CPU list like "0-3,8". Returns the number of CPUs.
+static int AffinityParseList(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*list) {
+    char *end;
+    long first = strtol(list, &end, 10);
+    long last = first;
+    if (end == list)
+      break;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (; first <= last && first < CPU_SETSIZE; first++)
+      CPU_SET(first, set);
+    list = (*end == ',') ? end + 1 : end;
+  }
+  return CPU_COUNT(set);
+}
+
+// Formats a CPU set as list
+static void AffinityFormatList(const cpu_set_t *set, char *buf, int size) {
+  int cpu, first = -1, length = 0;
+
+  buf[0] = '\0';
+  for (cpu = 0; cpu <= CPU_SETSIZE && length < size; cpu++) {
+    int in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+    if (in && first < 0)
+      first = cpu;
+    else if (!in && first >= 0) {
+      length += snprintf(buf + length, size - length, "%s%d", length ? "," : "", first);
+      if (cpu - 1 > first && length < size)
+        length += snprintf(buf + length, size - length, "-%d", cpu - 1);
+      first = -1;
+    }
+  }
+}
+
+static int AffinityReadList(const char *path, cpu_set_t *set) {
+  char line[1024];
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return 0;
+  int count = 0;
+  if (fgets(line, sizeof(line), file))
+    count = AffinityParseList(line, set);
+  fclose(file);
+  return count;
+}
+
+// Finds the IRQ of the host controller behind USB bus "busnum". The root hub
+// /sys/bus/usb/devices/usbN sits right below the PCI device. With MSI(-X)
+// the first vector is the one of the primary interrupter.
+static int AffinityBusIRQ(int busnum) {
+  char path[PATH_MAX + 16];
+  char hcd[PATH_MAX];
+  int irq = -1;
+
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%d", busnum);
+  if (realpath(path, hcd) == NULL)
+    return -1;
+  char *slash = strrchr(hcd, '/');
+  if (slash == NULL)
+    return -1;
+  *slash = '\0';
+
+  snprintf(path, sizeof(path), "%s/msi_irqs", hcd);
+  DIR *dir = opendir(path);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      int vector = atoi(entry->d_name);
+      if (vector > 0 && (irq < 0 || vector < irq))
+        irq = vector;
+    }
+    closedir(dir);
+  }
+
+  if (irq < 0) {
+    snprintf(path, sizeof(path), "%s/irq", hcd);
+    FILE *file = fopen(path, "r");
+    if (file) {
+      if (fscanf(file, "%d", &irq) != 1 || irq <= 0)
+        irq = -1;
+      fclose(file);
+    }
+  }
+
+  return irq;
+}
+
+// Of the CPUs in "set", returns the one which handled most of the interrupts
+// of "irq" according to /proc/interrupts. -1 if there are no counts.
+static int AffinityBusiestCPU(int irq, const cpu_set_t *set) {
+  char *line = NULL;
+  size_t length = 0;
+  int cpus[CPU_SETSIZE];
+  int columns = 0;
+  int busiest = -1;
+
+  FILE *file = fopen("/proc/interrupts", "r");
+  if (file == NULL)
+    return -1;
+
+  // Header names the CPU of each column
+  if (getline(&line, &length, file) > 0) {
+    char *pos = line;
+    int cpu, n;
+    while (columns < CPU_SETSIZE && sscanf(pos, " CPU%d%n", &cpu, &n) == 1) {
+      cpus[columns++] = cpu;
+      pos += n;
+    }
+  }
+
+  while (getline(&line, &length, file) > 0) {
+    char *pos;
+    if (strtol(line, &pos, 10) != irq || *pos != ':')
+      continue;
+    pos++;
+
+    unsigned long long most = 0;
+    int column;
+    for (column = 0; column < columns; column++) {
+      char *end;
+      unsigned long long count = strtoull(pos, &end, 10);
+      if (end == pos)
+        break;
+      pos = end;
+      if (CPU_ISSET(cpus[column], set) && count > most) {
+        most = count;
+        busiest = cpus[column];
+      }
+    }
+    break;
+  }
+
+  free(line);
+  fclose(file);
+  return busiest;
+}
+
+// Gets the CPUs sharing the highest cache level with "cpu"
+static int AffinityLLC(int cpu, cpu_set_t *set) {
+  char path[PATH_MAX];
+  int index, level, best = -1;
+
+  for (index = 0; ; index++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+      break;
+    if (fscanf(file, "%d", &level) == 1 && level > best) {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+      if (AffinityReadList(path, set) > 0)
+        best = level;
+    }
+    fclose(file);
+  }
+
+  return best < 0 ? -1 : 0;
+}
+
+// Pins the calling thread close to the interrupt of the host controller of
+// USB bus "busnum". On success "desc" describes where the thread went.
+int AffinityPinToBus(int busnum, int mode, char *desc, int size) {
+  char path[64];
+  char list[256];
+  cpu_set_t set;
+
+  int irq = AffinityBusIRQ(busnum);
+  if (irq < 0)
+    return -1;
+
+  // Without effective_affinity (older kernels) the configured one has to do
+  snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+  if (AffinityReadList(path, &set) == 0) {
+    snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+    if (AffinityReadList(path, &set) == 0)
+      return -1;
+  }
+
+  // Narrow a multi CPU affinity down to the CPU actually doing the work
+  int cpu = AffinityBusiestCPU(irq, &set);
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+  }
+
+  if (mode == AFFINITY_LLC) {
+    if (cpu < 0) {
+      for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &set); cpu++);
+    }
+    if (cpu < CPU_SETSIZE)
+      AffinityLLC(cpu, &set);
+  }
+
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    return -1;
+
+  AffinityFormatList(&set, list, sizeof(list));
+  snprintf(desc, size, "CPU %s (IRQ %d)", list, irq);
+  return 0;
+}
@@ -0,0 +1,24 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Where to run the handler thread of a controller
+#define AFFINITY_OFF  0  // Wherever the scheduler likes
+#define AFFINITY_CPU  1  // CPU which services the USB host controller IRQ
+#define AFFINITY_LLC  2  // All CPUs sharing the last level cache with it
+
+int AffinityPinToBus(int busnum, int mode, char *desc, int size);
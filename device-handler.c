@@ -23,23 +23,30 @@
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <linux/uinput.h>
 #include "device-handler.h"
 #include "usb.h"
 #include "uinput.h"
-#include "ps3-device.h"
-#include "ps4-device.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "latency-probe.h"
+#include "output.h"
+#include "recovery.h"
+#include "affinity.h"
+#include "hid-plan.h"
+#include "device-types.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "pad.h"
 
-struct RumbleArgs {
-  int fduinput;
-  libusb_device_handle *usbdev;
-  int devtype;
-};
+#define MOTION_MAX_DT_US 20000
 
 void *DeviceHandlerThreadRumble (void *attr) {
-  struct RumbleArgs *args = (struct RumbleArgs *)attr;
+  struct Pad *pad = (struct Pad *)attr;
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+  MetricsThreadStart(&pad->metrics, METRICS_THREAD_RUMBLE);
 
   struct input_event event;
 
@@ -47,10 +54,10 @@ void *DeviceHandlerThreadRumble (void *attr) {
   int strong = 0;
   int weak = 0;
 
-  printf("Startup: %d\n", args->fduinput);
+  printf("Startup: %d\n", pad->fduinput);
 
   while (1) {
-    ssize_t n = read(args->fduinput, &event, sizeof(event));
+    ssize_t n = read(pad->fduinput, &event, sizeof(event));
     if (n == -1) {
       if (errno == EINTR) {
         printf("EINTR\n");
@@ -69,18 +76,29 @@ void *DeviceHandlerThreadRumble (void *attr) {
 
     printf("Received something\n");
 
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    FlightRecorderWrite(&pad->recorder, FLIGHT_FF_EVENT, &now, &event, sizeof(event));
+
     if (event.type == EV_FF && event.code == effect_id) {
-      int ret;
-      if (args->devtype == PS3_DEVICE)
-        ret = PS3SendRumbleUSB(args->usbdev, event.value ? weak : 0, event.value ? strong : 0);
-      else
-        ret = PS4SendRumbleUSB(args->usbdev, event.value ? weak : 0, event.value ? strong : 0);
+      // Don't get cancelled while holding the output lock
+      int oldstate;
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+      int ret = pad->args.type->send_rumble(&pad->output, event.value ? weak : 0, event.value ? strong : 0);
+      pthread_setcancelstate(oldstate, NULL);
+      if (event.value)
+        MetricsAdd(&pad->metrics.ff_plays, 1);
       printf("Return EV_FF: %d\n", ret);
+
+      int32_t rumble[3] = {event.value ? weak : 0, event.value ? strong : 0, ret};
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      FlightRecorderWrite(&pad->recorder, FLIGHT_RUMBLE, &now, rumble, sizeof(rumble));
     }
     else if (event.type == EV_UINPUT) {
       printf("EV_UINPUT %d\n", event.code);
       if (event.code == UI_FF_UPLOAD) {
         printf("UI_FF_UPLOAD start\n");
+        MetricsAdd(&pad->metrics.ff_uploads, 1);
         struct uinput_ff_upload upload;
         memset(&upload, 0, sizeof(upload));
 
@@ -88,7 +106,7 @@ void *DeviceHandlerThreadRumble (void *attr) {
 
         printf("UI_FF_UPLOAD middle\n");
         int ret;
-        ret = ioctl(args->fduinput, UI_BEGIN_FF_UPLOAD, &upload);
+        ret = ioctl(pad->fduinput, UI_BEGIN_FF_UPLOAD, &upload);
         if (ret < 0) {
           printf("first ioctl failed %d %s\n", ret, strerror(errno));
         }
@@ -101,7 +119,7 @@ void *DeviceHandlerThreadRumble (void *attr) {
           printf("Effect uploaded\n");
         }
 
-        ret = ioctl(args->fduinput, UI_END_FF_UPLOAD, &upload);
+        ret = ioctl(pad->fduinput, UI_END_FF_UPLOAD, &upload);
         if (ret < 0) {
           printf("second ioctl failed %d %s\n", ret, strerror(errno));
         }
@@ -114,8 +132,8 @@ void *DeviceHandlerThreadRumble (void *attr) {
         erase.request_id = event.value;
 
         // Doesn't make sense to actually erase something...
-        ioctl(args->fduinput, UI_BEGIN_FF_ERASE, &erase);
-        ioctl(args->fduinput, UI_END_FF_ERASE, &erase);
+        ioctl(pad->fduinput, UI_BEGIN_FF_ERASE, &erase);
+        ioctl(pad->fduinput, UI_END_FF_ERASE, &erase);
         printf("Event erased\n");
       }
     }
@@ -124,69 +142,247 @@ void *DeviceHandlerThreadRumble (void *attr) {
   return NULL;
 }
 
+// Moves the handler thread next to the interrupt of its host controller
+static void PinHandler(struct Pad *pad) {
+  char desc[sizeof(pad->affinity_desc)];
+
+  if (AffinityPinToBus(pad->args.busnum, pad->affinity, desc, sizeof(desc)) < 0) {
+    syslog(LOG_WARNING, "Controller %03d/%03d: can't find host controller IRQ, not pinned",
+           pad->args.busnum, pad->args.devnum);
+    return;
+  }
+  if (strcmp(desc, pad->affinity_desc) != 0) {
+    syslog(LOG_INFO, "Controller %03d/%03d: handler on %s",
+           pad->args.busnum, pad->args.devnum, desc);
+    strcpy(pad->affinity_desc, desc);
+  }
+}
+
+// Runs the orientation filter on the current report
+static void HandleMotion(struct Pad *pad, const struct timespec *now) {
+  struct MotionMsg motion;
+
+  int dt_us = (now->tv_sec - pad->motion_time.tv_sec) * 1000000 +
+              (now->tv_nsec - pad->motion_time.tv_nsec) / 1000;
+  pad->motion_time = *now;
+
+  // Don't let a long pause in reports throw the filter off
+  if (dt_us > MOTION_MAX_DT_US)
+    dt_us = MOTION_MAX_DT_US;
+
+  pad->args.type->decode_motion(pad->report, &motion);
+  OrientationUpdate(&pad->motion, &motion, dt_us);
+  UinputSendMotionMsg(pad->fdmotion, &pad->motion);
+}
+
 void *DeviceHandlerThreadUSB (void *attr) {
+  struct Pad *pad = (struct Pad *)attr;
+  const struct DeviceType *type = pad->args.type;
+  pad->threads = 1;
+  MetricsThreadStart(&pad->metrics, METRICS_THREAD_USB);
+  if (pad->affinity)
+    PinHandler(pad);
+
   // Open USB device
-  libusb_device_handle *usbdev;
-  int devtype = ((struct USBDeviceHandlerArgs *)attr)->devtype;
-  int ret = USBOpenDevice((struct USBDeviceHandlerArgs *)attr, &usbdev);
-  free(attr);
+  int ret = USBOpenDevice(&pad->args, &pad->usbdev);
   if (ret < 0) {
     syslog(LOG_ERR, "Failed to open controller device");
+    pad->usbdev = NULL;
+    PadFree(pad);
     return NULL;
   }
 
+  // Start recording raw traffic
+  if (pad->recorder_dir &&
+      FlightRecorderOpen(&pad->recorder, pad->recorder_dir, pad->args.busnum, pad->args.devnum) < 0)
+    syslog(LOG_ERR, "Failed to create flight recorder in %s", pad->recorder_dir);
+
   // Enable controller
-  if (devtype == PS3_DEVICE) {
-    if (PS3SetOperationalUSB(usbdev) < 0) {
-      syslog(LOG_ERR, "Failed to enable PS3 controller");
-      libusb_close(usbdev);
+  if (type->init) {
+    if (type->init(pad->usbdev) < 0) {
+      syslog(LOG_ERR, "Failed to enable %s", type->name);
+      PadCloseFlightRecorder(pad, 0);
+      USBCloseDevice(pad->usbdev);
+      PadFree(pad);
       return NULL;
     }
   }
 
+  // Compile the report descriptor if requested, fall back to the decoder
+  // of the device type if that doesn't work
+  if (pad->hid_plan && type->hid_buttons) {
+    pad->plan = HIDPlanLoad(pad->usbdev, type, pad->plan_cache_dir);
+    if (pad->plan)
+      syslog(LOG_INFO, "Controller %03d/%03d: decode plan with %d ops",
+             pad->args.busnum, pad->args.devnum, pad->plan->count);
+    else
+      syslog(LOG_WARNING, "Controller %03d/%03d: no usable report descriptor, using %s decoder",
+             pad->args.busnum, pad->args.devnum, type->name);
+  }
+
   // Open Uinput device
-  int fduinput = UinputInit();
-  if (fduinput < 0) {
+  pad->fduinput = UinputInit(pad->profile);
+  if (pad->fduinput < 0) {
     syslog(LOG_ERR, "Uinput Init failed!");
-    libusb_close(usbdev);
+    free(pad->plan);
+    PadCloseFlightRecorder(pad, 0);
+    USBCloseDevice(pad->usbdev);
+    PadFree(pad);
     return NULL;
   }
 
+  // Open motion device if requested and supported
+  if (pad->orientation && type->decode_motion) {
+    pad->fdmotion = UinputInitMotion(pad->profile);
+    if (pad->fdmotion < 0)
+      syslog(LOG_ERR, "Uinput Init for motion device failed!");
+    OrientationInit(&pad->motion);
+    clock_gettime(CLOCK_MONOTONIC, &pad->motion_time);
+  }
+
+  // Start reading back our own events if requested
+  if (pad->latency_probe) {
+    struct LatencyProbe *probe = malloc(sizeof(struct LatencyProbe));
+    pthread_attr_t tattr;
+    int ret = -1;
+    if (probe && PadThreadAttrInit(&tattr) == 0) {
+      ret = LatencyProbeStart(probe, pad->fduinput, &tattr);
+      pthread_attr_destroy(&tattr);
+    }
+    if (ret == 0) {
+      PadSwapProbe(pad, probe);
+      pad->threads++;
+    }
+    else {
+      syslog(LOG_ERR, "Failed to start latency probe!");
+      free(probe);
+    }
+  }
+
+  // Set up output rate limiting
+  if (OutputStart(pad) < 0)
+    syslog(LOG_ERR, "Failed to set up output rate limit, sending every frame");
+
+  // Rumble goes over the interrupt OUT endpoint if the controller has one
+  USBOutputInit(&pad->output, pad->usbdev, type);
+
   // Launch thread to handle rumble events
-  pthread_t tid_rumble;
-  struct RumbleArgs rargs;
+  int rumble = 0;
   if (1) { // TODO: Make this configurable
-    rargs.fduinput = fduinput;
-    rargs.usbdev = usbdev;
-    rargs.devtype = devtype;
-    pthread_create(&tid_rumble, NULL, &DeviceHandlerThreadRumble, (void *)&rargs);
+    pthread_attr_t tattr;
+    if (PadThreadAttrInit(&tattr) == 0) {
+      if (pthread_create(&pad->tid_rumble, &tattr, &DeviceHandlerThreadRumble, (void *)pad) == 0) {
+        rumble = 1;
+        pad->threads++;
+      }
+      pthread_attr_destroy(&tattr);
+    }
+    if (!rumble)
+      syslog(LOG_ERR, "Failed to start rumble thread!");
   }
 
   // Main loop
   while(1) {
     struct XpadMsg msg_out;
+    int transferred;
 
-    if (devtype == PS3_DEVICE)
-      ret = PS3PollInputUSB(usbdev, &msg_out);
-    else
-      ret = PS4PollInputUSB(usbdev, &msg_out);
+    if (__atomic_load_n(&pad->removed, __ATOMIC_RELAXED)) {
+      syslog(LOG_DEBUG, "Controller %03d/%03d removed", pad->args.busnum, pad->args.devnum);
+      break;
+    }
+
+    // Output report lost on the interrupt endpoint
+    USBOutputFlush(&pad->output);
+
+    // IRQ affinity may have changed since
+    if (__atomic_exchange_n(&pad->affinity_stale, 0, __ATOMIC_RELAXED))
+      PinHandler(pad);
 
+    ret = USBReadReport(pad->usbdev, type, pad->report, &transferred,
+                        RecoveryReadTimeout(pad));
     if (ret < 0) {
+      if (ret != LIBUSB_ERROR_TIMEOUT)
+        MetricsUSBError(&pad->metrics, ret);
+
+      // Timeouts, stalls and transfer errors are handled in place
+      if (RecoveryHandleError(pad, ret) == 0)
+        continue;
+
       printf("    ERROR: Controller did not return values %d\n", ret);
+      // Unplugging is no reason to keep a record
+      if (ret != LIBUSB_ERROR_NO_DEVICE && !__atomic_load_n(&pad->removed, __ATOMIC_RELAXED))
+        FlightRecorderDump(&pad->recorder);
       break;
     }
 
-    UinputSendXpadMsg(fduinput, msg_out);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    FlightRecorderWrite(&pad->recorder, FLIGHT_INPUT_REPORT, &now, pad->report, transferred);
+    if (!RecoveryReportReceived(pad, transferred, &now))
+      continue;
+
+    if (type->decode_timestamp)
+      TimeSyncUpdate(&pad->timesync, type, type->decode_timestamp(pad->report), &now);
+
+    if (pad->fdmotion >= 0)
+      HandleMotion(pad, &now);
+
+    // Skip reports which only changed in bits we don't use
+    if (pad->metrics.reports == 0)
+      PadFirstReport(pad, &now);
+    MetricsAdd(&pad->metrics.reports, 1);
+    if (pad->have_last_report &&
+        !DeviceReportChanged(pad->report, pad->last_report, type->input_mask)) {
+      pad->reports_unchanged++;
+      continue;
+    }
+    memcpy(pad->last_report, pad->report, USB_MAX_REPORT_SIZE);
+    pad->have_last_report = 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pad->plan)
+      HIDPlanDecode(pad->plan, pad->report, &msg_out);
+    else
+      type->decode(pad->report, &msg_out);
+
+    // The latency probe needs a timestamp on each frame to find it again.
+    // Without device clock, the host receive time is used.
+    uint32_t usec = 0;
+    if (type->decode_timestamp)
+      usec = pad->timesync.device_ns / 1000;
+    else if (pad->probe)
+      usec = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+    OutputFrame(pad, &msg_out, type->decode_timestamp || pad->probe, usec);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pad->decode_ns += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                      (end.tv_nsec - start.tv_nsec);
   }
 
   // Close rumble thread
-  if (1) { // TODO: Make this configurable
-    pthread_cancel(tid_rumble);
-    pthread_join(tid_rumble, NULL);
+  if (rumble) {
+    pthread_cancel(pad->tid_rumble);
+    pthread_join(pad->tid_rumble, NULL);
+    MetricsThreadStop(&pad->metrics, METRICS_THREAD_RUMBLE);
+  }
+
+  USBOutputClose(&pad->output);
+  OutputStop(pad);
+
+  struct LatencyProbe *probe = PadSwapProbe(pad, NULL);
+  if (probe) {
+    LatencyProbeStop(probe);
+    free(probe);
   }
 
+  free(pad->plan);
+
   // Close open devices
-  libusb_close(usbdev);
-  close(fduinput);
+  PadCloseFlightRecorder(pad, 0);
+  USBCloseDevice(pad->usbdev);
+  close(pad->fduinput);
+  if (pad->fdmotion >= 0)
+    close(pad->fdmotion);
+  PadFree(pad);
   return NULL;
 }
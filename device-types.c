@@ -0,0 +1,105 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "usb.h"
+#include "uinput.h"
+#include "device-types.h"
+#include "ps3-device.h"
+#include "ps4-device.h"
+
+// All supported controllers. Add new models here.
+static const struct DeviceType *device_types[] = {
+  &PS3Device,
+  &PS4Device,
+  &PS4v2Device
+};
+#define DEVICE_TYPES_COUNT (sizeof(device_types)/sizeof(device_types[0]))
+
+// Open addressing hash table on VID/PID. Has to stay well above the number
+// of device types so lookups end after one or two probes.
+#define DEVICE_HASH_BITS 4
+#define DEVICE_HASH_SIZE (1 << DEVICE_HASH_BITS)
+static const struct DeviceType *device_hash[DEVICE_HASH_SIZE];
+
+static unsigned int DeviceHash(uint16_t vendor, uint16_t product) {
+  uint32_t key = ((uint32_t)vendor << 16) | product;
+  return (key * 2654435761u) >> (32 - DEVICE_HASH_BITS);
+}
+
+// Fills the lookup table. Has to be called once before any lookup.
+void DeviceTypesInit() {
+  int i;
+  for (i = 0; i < DEVICE_TYPES_COUNT; i++) {
+    const struct DeviceType *type = device_types[i];
+    unsigned int slot = DeviceHash(type->vendor, type->product);
+    while (device_hash[slot] != NULL)
+      slot = (slot + 1) & (DEVICE_HASH_SIZE - 1);
+    device_hash[slot] = type;
+  }
+}
+
+// Returns the device type for the given IDs or NULL if not supported
+const struct DeviceType *DeviceTypeLookup(uint16_t vendor, uint16_t product) {
+  unsigned int slot = DeviceHash(vendor, product);
+  const struct DeviceType *type;
+  while ((type = device_hash[slot]) != NULL) {
+    if (type->vendor == vendor && type->product == product)
+      return type;
+    slot = (slot + 1) & (DEVICE_HASH_SIZE - 1);
+  }
+  return NULL;
+}
+
+// Compares two input reports but only looks at the bits set in "mask". All
+// three buffers have to be USB_MAX_REPORT_SIZE bytes long.
+int DeviceReportChanged(const unsigned char *a, const unsigned char *b,
+                        const unsigned char *mask) {
+  int i;
+#if defined(__AVX2__)
+  __m256i diff = _mm256_setzero_si256();
+  for (i = 0; i < USB_MAX_REPORT_SIZE; i += 32) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                 _mm256_loadu_si256((const __m256i *)(b + i)));
+    diff = _mm256_or_si256(diff, _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(mask + i))));
+  }
+  return !_mm256_testz_si256(diff, diff);
+#elif defined(__SSE2__)
+  __m128i diff = _mm_setzero_si128();
+  for (i = 0; i < USB_MAX_REPORT_SIZE; i += 16) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                              _mm_loadu_si128((const __m128i *)(b + i)));
+    diff = _mm_or_si128(diff, _mm_and_si128(x, _mm_loadu_si128((const __m128i *)(mask + i))));
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff;
+#else
+  uint64_t diff = 0;
+  for (i = 0; i < USB_MAX_REPORT_SIZE; i += 8) {
+    uint64_t x, y, m;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    memcpy(&m, mask + i, 8);
+    diff |= (x ^ y) & m;
+  }
+  return diff != 0;
+#endif
+}
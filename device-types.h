@@ -0,0 +1,64 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+struct MotionMsg;
+struct HIDButtonMap;
+
+// Describes one supported controller model. Everything model specific is
+// reached through this struct, so the handler threads never have to check
+// which kind of controller they are talking to.
+struct DeviceType {
+  uint16_t vendor;
+  uint16_t product;
+  const char *name;
+
+  int report_size;             // Size of one input report
+  unsigned char endpoint_in;   // Interrupt IN endpoint for input reports
+  unsigned char endpoint_out;  // Interrupt OUT endpoint (0 = control pipe)
+  int control_report_id;       // SET_REPORT payload starts with the report ID
+
+  // Sample clock of the device. One tick is num/den nanoseconds, the raw
+  // counter wraps at "timestamp_mask".
+  uint32_t timestamp_mask;
+  uint32_t timestamp_ns_num;
+  uint32_t timestamp_ns_den;
+
+  // Bits of the input report which "decode" actually uses. Reports which
+  // only differ in other bits are not decoded again.
+  const unsigned char *input_mask;
+
+  // HID button numbers as XPAD_BTN_*. Lets the report descriptor drive
+  // decoding (see hid-plan.h). NULL if the descriptor is of no use.
+  const struct HIDButtonMap *hid_buttons;
+
+  // Called once after the device has been opened. May be NULL.
+  int (*init)(libusb_device_handle *usbdev);
+  // Translates one raw input report
+  void (*decode)(const unsigned char *report, struct XpadMsg *msg_out);
+  // Extracts the raw sample counter. NULL if the device has none.
+  uint32_t (*decode_timestamp)(const unsigned char *report);
+  // Extracts gyro and accelerometer data. NULL if the device has no IMU.
+  void (*decode_motion)(const unsigned char *report, struct MotionMsg *motion_out);
+  // Sets the rumble motors
+  int (*send_rumble)(struct USBOutput *out, int weak, int strong);
+};
+
+void DeviceTypesInit();
+const struct DeviceType *DeviceTypeLookup(uint16_t vendor, uint16_t product);
+int DeviceReportChanged(const unsigned char *a, const unsigned char *b,
+                        const unsigned char *mask);
@@ -0,0 +1,126 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "flight-recorder.h"
+
+#define FLIGHT_RECORDER_SIZE (sizeof(struct FlightRecorderHeader) + \
+                              FLIGHT_RECORDER_RECORDS * sizeof(struct FlightRecord))
+
+// Slots at the old end of the ring which a dump leaves to concurrent writers
+#define FLIGHT_DUMP_MARGIN 16
+
+// Creates the ring file for one controller and maps it. The file survives
+// crashes of the daemon, so it can be inspected afterwards.
+int FlightRecorderOpen(struct FlightRecorder *fr, const char *dir, int busnum, int devnum) {
+  memset(fr, 0, sizeof(struct FlightRecorder));
+  snprintf(fr->path, sizeof(fr->path), "%s/pad-%03d-%03d.rec", dir, busnum, devnum);
+
+  int fd = open(fr->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, FLIGHT_RECORDER_SIZE) < 0) {
+    close(fd);
+    unlink(fr->path);
+    return -1;
+  }
+
+  void *map = mmap(NULL, FLIGHT_RECORDER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    unlink(fr->path);
+    return -1;
+  }
+
+  fr->header = (struct FlightRecorderHeader *)map;
+  fr->records = (struct FlightRecord *)(fr->header + 1);
+  fr->header->record_size = sizeof(struct FlightRecord);
+  fr->header->records = FLIGHT_RECORDER_RECORDS;
+  fr->header->head = 0;
+  __atomic_store_n(&fr->header->magic, FLIGHT_RECORDER_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Unmaps the ring. The file is removed unless "keep" is set.
+void FlightRecorderClose(struct FlightRecorder *fr, int keep) {
+  if (!fr->header)
+    return;
+  munmap(fr->header, FLIGHT_RECORDER_SIZE);
+  fr->header = NULL;
+  fr->records = NULL;
+  if (!keep)
+    unlink(fr->path);
+}
+
+// Writes the current ring contents, oldest first, as text next to the
+// ring file.
+int FlightRecorderDump(struct FlightRecorder *fr) {
+  char path[sizeof(fr->path) + 32];
+  uint64_t head, seq;
+  int i;
+
+  if (!fr->header)
+    return -1;
+
+  snprintf(path, sizeof(path), "%s.%lld.dump", fr->path, (long long)time(NULL));
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return -1;
+
+  // The oldest slots are the next ones to be overwritten, so some are left
+  // out. Records which change while being copied get dropped.
+  head = __atomic_load_n(&fr->header->head, __ATOMIC_ACQUIRE);
+  seq = head > FLIGHT_RECORDER_RECORDS - FLIGHT_DUMP_MARGIN ?
+        head - (FLIGHT_RECORDER_RECORDS - FLIGHT_DUMP_MARGIN) + 1 : 1;
+  for (; seq <= head; seq++) {
+    struct FlightRecord *slot = &fr->records[seq & (FLIGHT_RECORDER_RECORDS - 1)];
+    struct FlightRecord rec;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+    memcpy(&rec, slot, sizeof(rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+        rec.length > FLIGHT_RECORD_DATA)
+      continue;
+
+    const char *type = "?";
+    if (rec.type == FLIGHT_INPUT_REPORT)
+      type = "IN";
+    else if (rec.type == FLIGHT_FF_EVENT)
+      type = "FF";
+    else if (rec.type == FLIGHT_RUMBLE)
+      type = "RUMBLE";
+
+    fprintf(file, "%lld.%09lld %s", (long long)(rec.time_ns / 1000000000LL),
+            (long long)(rec.time_ns % 1000000000LL), type);
+    for (i = 0; i < rec.length; i++)
+      fprintf(file, " %02x", rec.data[i]);
+    fprintf(file, "\n");
+  }
+
+  fclose(file);
+  syslog(LOG_INFO, "Flight recorder dumped to %s", path);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define FLIGHT_RECORDER_MAGIC    0x31524650  // "PFR1"
+#define FLIGHT_RECORDER_RECORDS  4096        // About 16 s of reports at 250 Hz
+#define FLIGHT_RECORD_DATA       64
+
+// Record types
+#define FLIGHT_INPUT_REPORT  1  // Raw interrupt IN report
+#define FLIGHT_FF_EVENT      2  // struct input_event read from uinput
+#define FLIGHT_RUMBLE        3  // weak, strong, result of the transfer
+
+struct FlightRecord {
+  uint64_t seq;                 // Written last. 0 while being written.
+  int64_t time_ns;              // CLOCK_MONOTONIC
+  uint16_t type;
+  uint16_t length;
+  uint32_t reserved;
+  unsigned char data[FLIGHT_RECORD_DATA];
+};
+
+// Start of the memory mapped file, followed by the records
+struct FlightRecorderHeader {
+  uint32_t magic;
+  uint32_t record_size;
+  uint32_t records;
+  uint32_t reserved;
+  uint64_t head;                // Number of records ever written
+};
+
+struct FlightRecorder {
+  struct FlightRecorderHeader *header;
+  struct FlightRecord *records;
+  char path[256];
+};
+
+int FlightRecorderOpen(struct FlightRecorder *fr, const char *dir, int busnum, int devnum);
+void FlightRecorderClose(struct FlightRecorder *fr, int keep);
+int FlightRecorderDump(struct FlightRecorder *fr);
+
+// Appends one record. Lock free and without syscalls, may be called from
+// several threads at once.
+static inline void FlightRecorderWrite(struct FlightRecorder *fr, int type,
+                                       const struct timespec *now,
+                                       const void *data, int length) {
+  if (!fr->header)
+    return;
+
+  uint64_t seq = __atomic_fetch_add(&fr->header->head, 1, __ATOMIC_RELAXED) + 1;
+  struct FlightRecord *rec = &fr->records[seq & (FLIGHT_RECORDER_RECORDS - 1)];
+
+  if (length > FLIGHT_RECORD_DATA)
+    length = FLIGHT_RECORD_DATA;
+  // Readers must not see the new data while seq still has the old value
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->time_ns = now->tv_sec * 1000000000LL + now->tv_nsec;
+  rec->type = type;
+  rec->length = length;
+  memcpy(rec->data, data, length);
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
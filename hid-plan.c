@@ -0,0 +1,326 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <limits.h>
+#include "usb.h"
+#include "uinput.h"
+#include "device-types.h"
+#include "hid-plan.h"
+
+#define HID_PLAN_MAGIC "PDP1"
+#define HID_MAX_DESCRIPTOR_SIZE 1024
+#define HID_MAX_USAGES 32
+
+// Item types and tags of the short items we care about
+#define HID_ITEM_MAIN   0
+#define HID_ITEM_GLOBAL 1
+#define HID_ITEM_LOCAL  2
+
+#define HID_MAIN_INPUT      0x8
+#define HID_GLOBAL_PAGE     0x0
+#define HID_GLOBAL_LOG_MIN  0x1
+#define HID_GLOBAL_SIZE     0x7
+#define HID_GLOBAL_ID       0x8
+#define HID_GLOBAL_COUNT    0x9
+#define HID_LOCAL_USAGE     0x0
+#define HID_LOCAL_USAGE_MIN 0x1
+#define HID_LOCAL_USAGE_MAX 0x2
+
+#define HID_PAGE_DESKTOP 0x01
+#define HID_PAGE_BUTTON  0x09
+
+static const int8_t hat_dx[8] = { 0,  1, 1, 1, 0, -1, -1, -1};
+static const int8_t hat_dy[8] = {-1, -1, 0, 1, 1,  1,  0, -1};
+
+// Maps one input field to a target. Returns -1 for fields we don't use.
+static int HIDPlanTarget(uint32_t usage, const struct HIDButtonMap *map, uint32_t *arg) {
+  uint16_t page = usage >> 16;
+  uint16_t id = usage & 0xffff;
+
+  if (page == HID_PAGE_BUTTON) {
+    if (id < 1 || id > map->count || !map->buttons[id - 1])
+      return -1;
+    *arg = map->buttons[id - 1];
+    return HID_TARGET_BUTTON;
+  }
+
+  if (page == HID_PAGE_DESKTOP) {
+    switch (id) {
+    case 0x30: return HID_TARGET_LX;
+    case 0x31: return HID_TARGET_LY;
+    case 0x32: return HID_TARGET_RX;
+    case 0x35: return HID_TARGET_RY;
+    case 0x33: return HID_TARGET_LT;
+    case 0x34: return HID_TARGET_RT;
+    case 0x39: return HID_TARGET_HAT;
+    }
+  }
+
+  return -1;
+}
+
+// Walks the report descriptor and emits one op for each input field of the
+// first input report which maps to something in struct XpadMsg
+int HIDPlanCompile(struct HIDPlan *plan, const unsigned char *desc, int length,
+                   const struct HIDButtonMap *map) {
+  uint32_t page = 0, report_size = 0, report_count = 0, report_id = 0;
+  int32_t logical_min = 0;
+  uint32_t usages[HID_MAX_USAGES];
+  int usage_count = 0;
+  uint32_t usage_min = 0, usage_max = 0;
+  int have_range = 0;
+  int have_input = 0;
+  uint64_t bits = 0;      // Position in the planned report
+  unsigned int found = 0;
+  int pos = 0;
+
+  memset(plan, 0, sizeof(struct HIDPlan));
+  memcpy(plan->magic, HID_PLAN_MAGIC, 4);
+
+  while (pos < length) {
+    unsigned char prefix = desc[pos++];
+
+    // Long items carry nothing for us
+    if (prefix == 0xfe) {
+      if (pos + 1 >= length)
+        break;
+      pos += 2 + desc[pos];
+      continue;
+    }
+
+    int size = (prefix & 3) == 3 ? 4 : (prefix & 3);
+    int type = (prefix >> 2) & 3;
+    int tag = prefix >> 4;
+    if (pos + size > length)
+      break;
+
+    uint32_t data = 0;
+    int i;
+    for (i = 0; i < size; i++)
+      data |= (uint32_t)desc[pos + i] << (8 * i);
+    int32_t sdata = data;
+    if (size == 1)
+      sdata = (int8_t)data;
+    else if (size == 2)
+      sdata = (int16_t)data;
+    pos += size;
+
+    if (type == HID_ITEM_GLOBAL) {
+      switch (tag) {
+      case HID_GLOBAL_PAGE: page = data; break;
+      case HID_GLOBAL_LOG_MIN: logical_min = sdata; break;
+      case HID_GLOBAL_SIZE: report_size = data; break;
+      case HID_GLOBAL_ID: report_id = data; break;
+      case HID_GLOBAL_COUNT: report_count = data; break;
+      }
+    }
+    else if (type == HID_ITEM_LOCAL) {
+      // Usages without page refer to the current usage page
+      if (size < 4)
+        data |= page << 16;
+      switch (tag) {
+      case HID_LOCAL_USAGE:
+        if (usage_count < HID_MAX_USAGES)
+          usages[usage_count++] = data;
+        break;
+      case HID_LOCAL_USAGE_MIN: usage_min = data; have_range = 1; break;
+      case HID_LOCAL_USAGE_MAX: usage_max = data; break;
+      }
+    }
+    else if (type == HID_ITEM_MAIN) {
+      if (tag == HID_MAIN_INPUT) {
+        if (!have_input) {
+          have_input = 1;
+          plan->report_id = report_id;
+          bits = report_id ? 8 : 0;
+        }
+
+        // Only the first input report gets planned. Constant fields
+        // (padding) and arrays are skipped.
+        if (report_id == plan->report_id) {
+          // The count comes from the device, stop once the fields are
+          // beyond anything we read
+          int variable = (data & 0x03) == 0x02;
+          uint32_t n;
+          for (n = 0; n < report_count && bits / 8 < USB_MAX_REPORT_SIZE; n++, bits += report_size) {
+            uint32_t usage, arg = 0;
+            if (!variable)
+              continue;
+            if (usage_count)
+              usage = usages[n < usage_count ? n : usage_count - 1];
+            else if (have_range && usage_min + n <= usage_max)
+              usage = usage_min + n;
+            else
+              continue;
+
+            int target = HIDPlanTarget(usage, map, &arg);
+            if (target < 0 || report_size > 24 || bits / 8 + 4 > USB_MAX_REPORT_SIZE ||
+                plan->count >= HID_PLAN_MAX_OPS)
+              continue;
+
+            // Axes are scaled to 8 bit, the hat is made zero based
+            if (target == HID_TARGET_HAT)
+              arg = logical_min;
+            else if (target != HID_TARGET_BUTTON)
+              arg = report_size > 8 ? report_size - 8 : 0;
+
+            struct HIDPlanOp *op = &plan->ops[plan->count++];
+            op->offset = bits / 8;
+            op->shift = bits % 8;
+            op->width = report_size;
+            op->target = target;
+            op->arg = arg;
+            found |= 1 << target;
+          }
+        }
+      }
+
+      // Locals only live until the next main item
+      usage_count = 0;
+      have_range = 0;
+    }
+  }
+
+  // Without sticks and buttons this is no gamepad we can drive
+  unsigned int required = (1 << HID_TARGET_BUTTON) | (1 << HID_TARGET_LX) | (1 << HID_TARGET_LY) |
+                          (1 << HID_TARGET_RX) | (1 << HID_TARGET_RY);
+  return (found & required) == required ? 0 : -1;
+}
+
+// 32 bit FNV-1a
+static uint32_t HIDPlanHash(const unsigned char *data, int length) {
+  uint32_t hash = 2166136261u;
+  int i;
+  for (i = 0; i < length; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+static int HIDPlanCacheRead(struct HIDPlan *plan, const char *path, uint32_t hash) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return -1;
+  int ok = fread(plan, sizeof(struct HIDPlan), 1, file) == 1 &&
+           memcmp(plan->magic, HID_PLAN_MAGIC, 4) == 0 &&
+           plan->descriptor_hash == hash && plan->count <= HID_PLAN_MAX_OPS;
+  fclose(file);
+
+  // Don't let a broken file make us read beyond the report or shift by
+  // more than the field has
+  int i;
+  for (i = 0; ok && i < plan->count; i++) {
+    const struct HIDPlanOp *op = &plan->ops[i];
+    if (op->offset + 4 > USB_MAX_REPORT_SIZE || op->shift >= 8 || op->width > 24 ||
+        op->target > HID_TARGET_HAT ||
+        (op->target != HID_TARGET_BUTTON && op->target != HID_TARGET_HAT && op->arg >= 24))
+      ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+// Written to a temporary file first, so other handlers never read half a plan
+static void HIDPlanCacheWrite(const struct HIDPlan *plan, const char *path) {
+  char tmp[PATH_MAX + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL)
+    return;
+  int ok = fwrite(plan, sizeof(struct HIDPlan), 1, file) == 1;
+  if (fclose(file) != 0 || !ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+// Gets the decode plan of a device. It is cached in "cache_dir" (may be
+// NULL) by vendor, product and descriptor hash, so the descriptor only gets
+// parsed on the first attach. Returns NULL if the device type has no button
+// map or the descriptor doesn't describe a usable gamepad. Caller frees.
+struct HIDPlan *HIDPlanLoad(libusb_device_handle *usbdev, const struct DeviceType *type,
+                            const char *cache_dir) {
+  unsigned char desc[HID_MAX_DESCRIPTOR_SIZE];
+  char path[PATH_MAX];
+
+  if (!type->hid_buttons)
+    return NULL;
+
+  int length = USBGetReportDescriptor(usbdev, desc, sizeof(desc));
+  if (length <= 0)
+    return NULL;
+  uint32_t hash = HIDPlanHash(desc, length);
+
+  struct HIDPlan *plan = malloc(sizeof(struct HIDPlan));
+  if (plan == NULL)
+    return NULL;
+
+  if (cache_dir) {
+    snprintf(path, sizeof(path), "%s/%04x-%04x-%08x.plan", cache_dir,
+             type->vendor, type->product, hash);
+    if (HIDPlanCacheRead(plan, path, hash) == 0)
+      return plan;
+  }
+
+  if (HIDPlanCompile(plan, desc, length, type->hid_buttons) < 0) {
+    free(plan);
+    return NULL;
+  }
+  plan->descriptor_hash = hash;
+
+  if (cache_dir)
+    HIDPlanCacheWrite(plan, path);
+  return plan;
+}
+
+// Runs a plan on one input report
+void HIDPlanDecode(const struct HIDPlan *plan, const unsigned char *report,
+                   struct XpadMsg *msg_out) {
+  const struct HIDPlanOp *op = plan->ops;
+  const struct HIDPlanOp *end = plan->ops + plan->count;
+
+  memset(msg_out, 0, sizeof(struct XpadMsg));
+  for (; op < end; op++) {
+    const unsigned char *p = report + op->offset;
+    uint32_t value = (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) >> op->shift;
+    value &= (1u << op->width) - 1;
+
+    switch (op->target) {
+    case HID_TARGET_BUTTON:
+      // Without branch, button states are too random to predict
+      msg_out->buttons |= op->arg & -(uint32_t)(value != 0);
+      break;
+    case HID_TARGET_LX: msg_out->abs_lx = value >> op->arg; break;
+    case HID_TARGET_LY: msg_out->abs_ly = value >> op->arg; break;
+    case HID_TARGET_RX: msg_out->abs_rx = value >> op->arg; break;
+    case HID_TARGET_RY: msg_out->abs_ry = value >> op->arg; break;
+    case HID_TARGET_LT: msg_out->abs_lt = value >> op->arg; break;
+    case HID_TARGET_RT: msg_out->abs_rt = value >> op->arg; break;
+    case HID_TARGET_HAT:
+      value -= op->arg;
+      if (value < 8) {
+        msg_out->abs_dx = hat_dx[value];
+        msg_out->abs_dy = hat_dy[value];
+      }
+      break;
+    }
+  }
+}
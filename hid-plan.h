@@ -0,0 +1,64 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A decode plan is the input report part of a HID report descriptor,
+// compiled down to the fields pspaddrv uses. Decoding a report then is one
+// pass over a flat array of ops.
+
+#define HID_PLAN_MAX_OPS 48
+
+// What an op writes to
+#define HID_TARGET_BUTTON  0  // Sets "arg" in buttons if the field is nonzero
+#define HID_TARGET_LX      1
+#define HID_TARGET_LY      2
+#define HID_TARGET_RX      3
+#define HID_TARGET_RY      4
+#define HID_TARGET_LT      5
+#define HID_TARGET_RT      6
+#define HID_TARGET_HAT     7  // 0 = up, clockwise in steps of 45 degrees
+
+struct HIDPlanOp {
+  uint8_t offset;  // Byte in the report (including the report ID)
+  uint8_t shift;   // Bit in that byte
+  uint8_t width;   // Bits, at most 24
+  uint8_t target;  // HID_TARGET_*
+  uint32_t arg;
+};
+
+struct HIDPlan {
+  char magic[4];
+  uint32_t descriptor_hash;
+  uint8_t report_id;     // 0 = device doesn't use report IDs
+  uint8_t count;
+  struct HIDPlanOp ops[HID_PLAN_MAX_OPS];
+};
+
+// Buttons of a device by HID button number, starting with button 1
+struct HIDButtonMap {
+  int count;
+  const uint32_t *buttons;  // XPAD_BTN_* or 0 to ignore
+};
+
+struct DeviceType;
+
+int HIDPlanCompile(struct HIDPlan *plan, const unsigned char *desc, int length,
+                   const struct HIDButtonMap *map);
+struct HIDPlan *HIDPlanLoad(libusb_device_handle *usbdev, const struct DeviceType *type,
+                            const char *cache_dir);
+void HIDPlanDecode(const struct HIDPlan *plan, const unsigned char *report,
+                   struct XpadMsg *msg_out);
@@ -0,0 +1,199 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/uinput.h>
+#include "latency-probe.h"
+
+#define LATENCY_PROBE_NICE      10
+#define LATENCY_PROBE_OPEN_TRIES 50  // evdev node may take a while to appear
+
+// Finds and opens the evdev node which belongs to an uinput device
+static int OpenEvdevNode(int fduinput) {
+  char sysname[64];
+  char path[128];
+  int tries;
+
+  if (ioctl(fduinput, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+    return -1;
+  snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+
+  for (tries = 0; tries < LATENCY_PROBE_OPEN_TRIES; tries++) {
+    DIR *dir = opendir(path);
+    if (dir) {
+      struct dirent *entry;
+      while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+          char devnode[300];
+          snprintf(devnode, sizeof(devnode), "/dev/input/%s", entry->d_name);
+          int fd = open(devnode, O_RDONLY);
+          if (fd >= 0) {
+            closedir(dir);
+            return fd;
+          }
+        }
+      }
+      closedir(dir);
+    }
+    usleep(20000);
+  }
+
+  return -1;
+}
+
+static int64_t TimespecNs(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Searches the ring for the frame with the given tag. Returns the frame's
+// sequence number or 0 if it already got overwritten.
+static uint64_t FindFrame(struct LatencyProbe *probe, uint32_t tag, int64_t *write_ns) {
+  uint64_t head = __atomic_load_n(&probe->seq, __ATOMIC_ACQUIRE);
+  uint64_t seq;
+
+  for (seq = head; seq > probe->last_seq && seq + LATENCY_PROBE_RING > head; seq--) {
+    struct LatencyProbeFrame *frame = &probe->ring[seq % LATENCY_PROBE_RING];
+    if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+    uint32_t frame_tag = frame->tag;
+    int64_t ns = frame->write_ns;
+    if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+    if (frame_tag == tag) {
+      *write_ns = ns;
+      return seq;
+    }
+  }
+
+  return 0;
+}
+
+static void *LatencyProbeThread(void *attr) {
+  struct LatencyProbe *probe = (struct LatencyProbe *)attr;
+  struct input_event event;
+  uint32_t tag = 0;
+  int have_tag = 0;
+
+  // Don't compete with the handler threads
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), LATENCY_PROBE_NICE);
+
+  while (read(probe->fdevdev, &event, sizeof(event)) == sizeof(event)) {
+    if (event.type == EV_MSC && event.code == MSC_TIMESTAMP) {
+      tag = event.value;
+      have_tag = 1;
+    }
+    else if (event.type == EV_SYN && event.code == SYN_DROPPED) {
+      probe->syn_dropped++;
+      have_tag = 0;
+    }
+    else if (event.type == EV_SYN && event.code == SYN_REPORT && have_tag) {
+      struct timespec now;
+      int64_t write_ns;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      have_tag = 0;
+
+      uint64_t seq = FindFrame(probe, tag, &write_ns);
+      if (seq == 0)
+        continue;
+
+      if (probe->last_seq)
+        probe->frames_missed += seq - probe->last_seq - 1;
+      probe->last_seq = seq;
+      probe->frames++;
+
+      int64_t latency = TimespecNs(&now) - write_ns;
+      if (latency > probe->max_ns)
+        probe->max_ns = latency;
+      int bucket = 0;
+      int64_t us = latency / 1000;
+      while (us > 1 && bucket < LATENCY_PROBE_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+      }
+      probe->histogram[bucket]++;
+    }
+  }
+
+  return NULL;
+}
+
+// Opens the evdev node of "fduinput" and starts the reader thread with
+// the thread attributes "tattr"
+int LatencyProbeStart(struct LatencyProbe *probe, int fduinput, const pthread_attr_t *tattr) {
+  memset(probe, 0, sizeof(struct LatencyProbe));
+  probe->fduinput = fduinput;
+  probe->fdevdev = OpenEvdevNode(fduinput);
+  if (probe->fdevdev < 0)
+    return -1;
+
+  if (pthread_create(&probe->tid, tattr, &LatencyProbeThread, (void *)probe) != 0) {
+    close(probe->fdevdev);
+    probe->fdevdev = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void LatencyProbeStop(struct LatencyProbe *probe) {
+  pthread_cancel(probe->tid);
+  pthread_join(probe->tid, NULL);
+  close(probe->fdevdev);
+  probe->fdevdev = -1;
+}
+
+// Remembers one frame written to uinput. Called from the handler thread.
+void LatencyProbeFrameWritten(struct LatencyProbe *probe, uint32_t tag, const struct timespec *now) {
+  uint64_t seq = probe->seq + 1;
+  struct LatencyProbeFrame *frame = &probe->ring[seq % LATENCY_PROBE_RING];
+
+  __atomic_store_n(&frame->seq, 0, __ATOMIC_RELEASE);
+  frame->tag = tag;
+  frame->write_ns = TimespecNs(now);
+  __atomic_store_n(&frame->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&probe->seq, seq, __ATOMIC_RELEASE);
+}
+
+// Writes the latency histogram to syslog
+void LatencyProbeReport(struct LatencyProbe *probe, const char *name) {
+  char buf[LATENCY_PROBE_BUCKETS * 24];
+  int len = 0;
+  int i;
+
+  syslog(LOG_INFO, "%s: uinput->evdev %llu frames, %llu missed, %llu SYN_DROPPED, max %lld us",
+         name, (unsigned long long)probe->frames, (unsigned long long)probe->frames_missed,
+         (unsigned long long)probe->syn_dropped, (long long)(probe->max_ns / 1000));
+
+  for (i = 0; i < LATENCY_PROBE_BUCKETS; i++) {
+    if (probe->histogram[i])
+      len += snprintf(buf + len, sizeof(buf) - len, " <%dus:%llu",
+                      2 << i, (unsigned long long)probe->histogram[i]);
+  }
+  if (len)
+    syslog(LOG_INFO, "%s: uinput->evdev latency%s", name, buf);
+}
@@ -0,0 +1,50 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LATENCY_PROBE_RING      256  // Frames remembered for matching
+#define LATENCY_PROBE_BUCKETS   16   // Histogram buckets, powers of two in us
+
+struct LatencyProbeFrame {
+  uint64_t seq;                 // 0 = unused
+  uint32_t tag;                 // MSC_TIMESTAMP value of the frame
+  int64_t write_ns;             // Time the frame was written to uinput
+};
+
+// Reads back the events of our uinput device from its evdev node and
+// measures the time from write() until the frame is readable.
+struct LatencyProbe {
+  int fduinput;
+  int fdevdev;
+  pthread_t tid;
+
+  uint64_t seq;                 // Sequence number of the last frame written
+  struct LatencyProbeFrame ring[LATENCY_PROBE_RING];
+
+  // Owned by the reader thread
+  uint64_t last_seq;            // Last frame seen on the evdev node
+  uint64_t frames;
+  uint64_t frames_missed;       // Written but never seen
+  uint64_t syn_dropped;         // Kernel buffer overruns
+  uint64_t histogram[LATENCY_PROBE_BUCKETS];
+  int64_t max_ns;
+};
+
+int LatencyProbeStart(struct LatencyProbe *probe, int fduinput, const pthread_attr_t *tattr);
+void LatencyProbeStop(struct LatencyProbe *probe);
+void LatencyProbeFrameWritten(struct LatencyProbe *probe, uint32_t tag, const struct timespec *now);
+void LatencyProbeReport(struct LatencyProbe *probe, const char *name);
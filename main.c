@@ -23,45 +23,105 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <syslog.h>
-#include "device-handler.h"
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
 #include "usb.h"
+#include "uinput.h"
+#include "device-handler.h"
+#include "device-types.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "affinity.h"
+#include "pad.h"
+#include "output.h"
 
 #define SONY_VENDOR_ID   "054c"
-#define PS3_PRODUCT_ID   "0268"
-#define PS4_PRODUCT_ID   "05c4"
+
+// Defaults for low footprint mode
+#define LOW_FOOTPRINT_PADS        4
+#define LOW_FOOTPRINT_STACK_KIB   64
+
+#define FLIGHT_RECORDER_DIR "/run/pspaddrv"
+
+#define HID_PLAN_CACHE_DIR "/var/cache/pspaddrv"
+
+#define IDLE_CHECK_DELAY_SEC 1
+
+static volatile sig_atomic_t accounting_requested = 0;
+static volatile sig_atomic_t dump_requested = 0;
+static int orientation_enabled = 0;
+static int latency_probe_enabled = 0;
+static int output_policy = OUTPUT_ALL;
+static int output_hz = 0;
+static const char *recorder_dir = FLIGHT_RECORDER_DIR;
+static const char *metrics_path = NULL;
+static int affinity = AFFINITY_OFF;
+static int hid_plan = 0;
+static const char *plan_cache_dir = HID_PLAN_CACHE_DIR;
+static int idle_exit = 0;
+
+// Virtual device profile, by default and for specific controller models
+#define MAX_PROFILE_OVERRIDES 8
+static const struct UinputProfile *profile = NULL;
+static struct {
+  uint16_t vendor;
+  uint16_t product;
+  const struct UinputProfile *profile;
+} profile_overrides[MAX_PROFILE_OVERRIDES];
+static int profile_override_count = 0;
+
+void AccountingSignalHandler(int signum) {
+  accounting_requested = 1;
+}
+
+void DumpSignalHandler(int signum) {
+  dump_requested = 1;
+}
 
 // This function starts a new thread to handle one game controller
-void StartUSBDeviceHandler(struct USBDeviceHandlerArgs *args) {
+void StartUSBDeviceHandler(struct Pad *pad) {
   pthread_attr_t tattr;
   pthread_t tid;
-  if (pthread_attr_init(&tattr) != 0) {
+  if (PadThreadAttrInit(&tattr) != 0) {
     syslog(LOG_ERR, "StartDeviceHandler: pthread_attr_init failed!");
+    PadFree(pad);
     return;
   }
   if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED) != 0) {
     syslog(LOG_ERR, "StartDeviceHandler: pthread_attr_setdetachstate failed!");
+    pthread_attr_destroy(&tattr);
+    PadFree(pad);
     return;
   }
 
-  if (pthread_create(&tid, &tattr, &DeviceHandlerThreadUSB, (void *)args) != 0)
+  if (pthread_create(&tid, &tattr, &DeviceHandlerThreadUSB, (void *)pad) != 0) {
     syslog(LOG_ERR, "StartDeviceHandler: Failed to start new thread!");
+    PadFree(pad);
+  }
+  pthread_attr_destroy(&tattr);
 }
 
 // Prefiltered events from udev land here
 void DeviceAdded(struct udev_device *dev) {
-  // Get product ID
+  // Get vendor and product ID
+  const char *vendor = NULL;
   const char *product = NULL;
+  vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
   product = udev_device_get_property_value(dev, "ID_MODEL_ID");
-  if (!product)
+  if (!vendor || !product)
     return;
 
-  // Only PS3/PS4 controller supported
-  int devtype;
-  if (strcasecmp(product, PS3_PRODUCT_ID) == 0)
-    devtype = PS3_DEVICE;
-  else if (strcasecmp(product, PS4_PRODUCT_ID) == 0)
-    devtype = PS4_DEVICE;
-  else
+  // Only known controllers supported
+  const struct DeviceType *type;
+  type = DeviceTypeLookup(strtol(vendor, NULL, 16), strtol(product, NULL, 16));
+  if (!type)
     return;
 
   // Get bus and device number
@@ -71,17 +131,89 @@ void DeviceAdded(struct udev_device *dev) {
   cdevnum = udev_device_get_property_value(dev, "DEVNUM");
   if (!cbusnum || !cdevnum)
     return;
-  struct USBDeviceHandlerArgs *args = malloc(sizeof(struct USBDeviceHandlerArgs));
-  if (args == NULL)
+  struct Pad *pad = PadAlloc();
+  if (pad == NULL) {
+    syslog(LOG_ERR, "No free slot for controller %s/%s", cbusnum, cdevnum);
     return;
-  args->busnum = atoi(cbusnum);
-  args->devnum = atoi(cdevnum);
-  args->devtype = devtype;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &pad->attach_time);
+  pad->args.busnum = atoi(cbusnum);
+  pad->args.devnum = atoi(cdevnum);
+  pad->args.type = type;
+  pad->orientation = orientation_enabled;
+  pad->latency_probe = latency_probe_enabled;
+  pad->output_policy = output_policy;
+  pad->output_hz = output_hz;
+  pad->recorder_dir = recorder_dir;
+  pad->affinity = affinity;
+  pad->profile = profile;
+  int i;
+  for (i = 0; i < profile_override_count; i++) {
+    if (profile_overrides[i].vendor == type->vendor && profile_overrides[i].product == type->product)
+      pad->profile = profile_overrides[i].profile;
+  }
+  pad->hid_plan = hid_plan;
+  pad->plan_cache_dir = plan_cache_dir;
+
+  StartUSBDeviceHandler(pad);
+}
+
+// Makes sure the handler goes away, even if it is busy recovering
+void DeviceRemoved(struct udev_device *dev) {
+  const char *cbusnum = udev_device_get_property_value(dev, "BUSNUM");
+  const char *cdevnum = udev_device_get_property_value(dev, "DEVNUM");
+  if (cbusnum && cdevnum)
+    PadRemoved(atoi(cbusnum), atoi(cdevnum));
+}
+
+// Parses "PROFILE" or "VID:PID=PROFILE" (IDs in hex)
+int ParseProfile(const char *arg) {
+  unsigned int vendor, product;
+  const char *equals = strchr(arg, '=');
+
+  if (!equals) {
+    profile = UinputProfileLookup(arg);
+    return profile ? 0 : -1;
+  }
+
+  if (profile_override_count >= MAX_PROFILE_OVERRIDES ||
+      sscanf(arg, "%x:%x=", &vendor, &product) != 2)
+    return -1;
+  const struct UinputProfile *override = UinputProfileLookup(equals + 1);
+  if (!override)
+    return -1;
+  profile_overrides[profile_override_count].vendor = vendor;
+  profile_overrides[profile_override_count].product = product;
+  profile_overrides[profile_override_count].profile = override;
+  profile_override_count++;
+  return 0;
+}
 
-  StartUSBDeviceHandler(args);
+void Usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-l] [-n PADS] [-s STACK_KIB] [-o] [-L] [-r HZ [-e]] [-R DIR] [-M SOCKET] [-a cpu|llc] [-H] [-x SECONDS]\n"
+                  "       [-p [VID:PID=]PROFILE]...\n"
+                  "  -l            Low footprint mode\n"
+                  "  -n PADS       Controllers preallocated in low footprint mode (default %d)\n"
+                  "  -s STACK_KIB  Stack size for controller threads in low footprint mode (default %d)\n"
+                  "  -o            Publish controller orientation on a motion sensor device\n"
+                  "  -L            Measure uinput to evdev latency of each controller\n"
+                  "  -r HZ         Send at most HZ frames per second, latest state wins\n"
+                  "  -e            With -r: Send button changes immediately, only limit axes\n"
+                  "  -R DIR        Directory for flight recorder files (default %s, \"\" = off)\n"
+                  "  -M SOCKET     Serve Prometheus metrics on this Unix socket\n"
+                  "  -a cpu|llc    Run controller handlers on the CPU (or its cache domain)\n"
+                  "                servicing their USB host controller interrupt\n"
+                  "  -H            Decode input as the HID report descriptor says, where\n"
+                  "                supported (plans are cached in %s)\n"
+                  "  -x SECONDS    Exit after SECONDS without controllers (for activation\n"
+                  "                by udev/systemd)\n"
+                  "  -p PROFILE    Virtual device to create: xbox360 (default), xboxone or\n"
+                  "                ds4. With VID:PID= only for that controller model.\n",
+          name, LOW_FOOTPRINT_PADS, LOW_FOOTPRINT_STACK_KIB, FLIGHT_RECORDER_DIR,
+          HID_PLAN_CACHE_DIR);
 }
 
-int main (void) {
+int main (int argc, char *argv[]) {
   struct udev *udev;
   struct udev_enumerate *enumerate;
   struct udev_list_entry *devices, *dev_list_entry;
@@ -89,11 +221,130 @@ int main (void) {
 
   struct udev_monitor *mon;
 
+  PadSetStartTime();
+
+  // Parse command line
+  int low_footprint = 0;
+  int slab_pads = LOW_FOOTPRINT_PADS;
+  int stack_kib = LOW_FOOTPRINT_STACK_KIB;
+  int opt;
+  while ((opt = getopt(argc, argv, "ln:s:oLr:eR:M:a:Hx:p:")) != -1) {
+    switch (opt) {
+    case 'l':
+      low_footprint = 1;
+      break;
+    case 'n':
+      slab_pads = atoi(optarg);
+      break;
+    case 's':
+      stack_kib = atoi(optarg);
+      break;
+    case 'o':
+      orientation_enabled = 1;
+      break;
+    case 'L':
+      latency_probe_enabled = 1;
+      break;
+    case 'r':
+      output_hz = atoi(optarg);
+      if (output_policy == OUTPUT_ALL)
+        output_policy = OUTPUT_CAP;
+      break;
+    case 'e':
+      output_policy = OUTPUT_CAP_AXES;
+      break;
+    case 'R':
+      recorder_dir = optarg[0] ? optarg : NULL;
+      break;
+    case 'M':
+      metrics_path = optarg;
+      break;
+    case 'p':
+      if (ParseProfile(optarg) < 0) {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'x':
+      idle_exit = atoi(optarg);
+      break;
+    case 'H':
+      hid_plan = 1;
+      break;
+    case 'a':
+      if (strcmp(optarg, "cpu") == 0)
+        affinity = AFFINITY_CPU;
+      else if (strcmp(optarg, "llc") == 0)
+        affinity = AFFINITY_LLC;
+      else {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      Usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (slab_pads < 1 || stack_kib < PTHREAD_STACK_MIN / 1024 ||
+      output_hz < 0 || idle_exit < 0 || (output_policy != OUTPUT_ALL && output_hz == 0)) {
+    Usage(argv[0]);
+    exit(1);
+  }
+
   // Init syslog
   openlog("pspaddrv", LOG_PID, LOG_DAEMON);
 
+  // Preallocate controller state in low footprint mode
+  if (low_footprint) {
+    if (PadSetup(slab_pads, (size_t)stack_kib * 1024) < 0) {
+      syslog(LOG_ERR, "Can't allocate controller slab");
+      exit(1);
+    }
+  }
+
+  // The report and dump signals are only taken in the main loop. Threads
+  // inherit the blocked mask, pselect unblocks them while waiting.
+  sigset_t signals, wait_mask;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, &wait_mask);
+  sigdelset(&wait_mask, SIGUSR1);
+  sigdelset(&wait_mask, SIGUSR2);
+
+  // SIGUSR1 writes a resource report to syslog
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = AccountingSignalHandler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // SIGUSR2 dumps the flight recorders
+  sa.sa_handler = DumpSignalHandler;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  if (recorder_dir && mkdir(recorder_dir, 0755) < 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "Can't create %s, flight recorder disabled", recorder_dir);
+    recorder_dir = NULL;
+  }
+
+  if (hid_plan && mkdir(plan_cache_dir, 0755) < 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "Can't create %s, decode plans are not cached", plan_cache_dir);
+    plan_cache_dir = NULL;
+  }
+
+  if (metrics_path && MetricsServerOpen(metrics_path) < 0)
+    syslog(LOG_ERR, "Can't listen on %s, metrics disabled", metrics_path);
+
   // Init libusb
-  libusb_init(NULL);
+  USBInit();
+
+  // Prepare device type lookup and virtual device profiles
+  DeviceTypesInit();
+  UinputProfilesInit();
+  if (!profile)
+    profile = UinputProfileLookup(NULL);
 
   // Create a new session for our daemon
   /*  if (daemon(0, 1) == -1) {
@@ -138,14 +389,89 @@ int main (void) {
   udev_enumerate_unref(enumerate);
 
   /* Begin polling for udev events. */
+  int idle = 0;
+  struct timespec idle_since;
   while (1) {
     fd_set fds;
     int ret;
 
     FD_ZERO(&fds);
     FD_SET(udev_monitor_fd, &fds);
+    int maxfd = MetricsServerFdSet(&fds, udev_monitor_fd);
 
-    ret = select(udev_monitor_fd+1, &fds, NULL, NULL, NULL);
+    // Without controllers, count down to exit if requested
+    struct timeval timeout;
+    struct timeval *ptimeout = NULL;
+    if (idle_exit && PadCount() == 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (!idle) {
+        idle = 1;
+        idle_since = now;
+      }
+      long remaining_ms = idle_exit * 1000L - ((now.tv_sec - idle_since.tv_sec) * 1000L +
+                                               (now.tv_nsec - idle_since.tv_nsec) / 1000000);
+      if (remaining_ms <= 0) {
+        // A controller which got plugged in just now would be lost, so
+        // pending events are handled first
+        struct pollfd pending = { .fd = udev_monitor_fd, .events = POLLIN };
+        if (poll(&pending, 1, 0) <= 0) {
+          syslog(LOG_INFO, "No controllers for %d seconds, exiting", idle_exit);
+          break;
+        }
+        idle = 0;
+      }
+      else {
+        timeout.tv_sec = remaining_ms / 1000;
+        timeout.tv_usec = (remaining_ms % 1000) * 1000;
+        ptimeout = &timeout;
+      }
+    }
+    else
+      idle = 0;
+
+    // After the last controller is gone, give its threads a moment to exit
+    // and check for anything left behind
+    int idle_check = PadIdleCheckPending();
+    if (idle_check && (!ptimeout || timeout.tv_sec >= IDLE_CHECK_DELAY_SEC)) {
+      timeout.tv_sec = IDLE_CHECK_DELAY_SEC;
+      timeout.tv_usec = 0;
+      ptimeout = &timeout;
+    }
+
+    // Metrics clients which never send their request get dropped
+    int metrics_ms = MetricsServerTimeout();
+    if (metrics_ms >= 0 &&
+        (!ptimeout || metrics_ms < timeout.tv_sec * 1000L + timeout.tv_usec / 1000)) {
+      timeout.tv_sec = metrics_ms / 1000;
+      timeout.tv_usec = (metrics_ms % 1000) * 1000;
+      ptimeout = &timeout;
+      idle_check = 0;  // Not due yet
+    }
+
+    struct timespec wait;
+    if (ptimeout) {
+      wait.tv_sec = timeout.tv_sec;
+      wait.tv_nsec = timeout.tv_usec * 1000;
+    }
+    ret = pselect(maxfd+1, &fds, NULL, NULL, ptimeout ? &wait : NULL, &wait_mask);
+
+    if (ret == 0 && idle_check)
+      PadIdleCheck();
+
+    if (accounting_requested) {
+      accounting_requested = 0;
+      PadAccountingReport();
+    }
+    if (dump_requested) {
+      dump_requested = 0;
+      PadDumpFlightRecorders();
+    }
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret >= 0)
+      MetricsServerHandle(ret > 0 ? &fds : NULL);
 
     /* Check if our file descriptor has received data. */
     if (ret > 0 && FD_ISSET(udev_monitor_fd, &fds)) {
@@ -153,13 +479,19 @@ int main (void) {
          select() ensured that this will not block. */
       dev = udev_monitor_receive_device(mon);
       if (dev) {
+        // Hotplug may come with IRQ rebalancing
+        if (affinity)
+          PadAffinityChanged();
+
         const char *action = NULL;
         action = udev_device_get_property_value(dev, "ACTION");
         const char *vendor = NULL;
         vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
-        if (strcmp(action, "add") == 0 &&
+        if (action && vendor && strcmp(action, "add") == 0 &&
             strcmp(vendor, SONY_VENDOR_ID) == 0)
           DeviceAdded(dev);
+        else if (action && strcmp(action, "remove") == 0)
+          DeviceRemoved(dev);
 
         udev_device_unref(dev);
       }
@@ -169,6 +501,10 @@ int main (void) {
     }
   }
 
+  MetricsServerClose();
+  udev_monitor_unref(mon);
   udev_unref(udev);
+  USBExit();
+  closelog();
   return 0;
 }
@@ -0,0 +1,225 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "usb.h"
+#include "uinput.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "latency-probe.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "pad.h"
+
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_CLIENT_TIMEOUT_MS 2000  // For sending the request
+#define METRICS_BUFFER_SIZE 65536
+
+static int metrics_fd = -1;
+static char metrics_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int metrics_clients[METRICS_MAX_CLIENTS];
+static int64_t metrics_client_since[METRICS_MAX_CLIENTS];  // Accept time in ms
+static char metrics_buffer[METRICS_BUFFER_SIZE];
+
+void MetricsUSBError(struct PadMetrics *metrics, int error) {
+  int index = -error;
+  if (index <= 0 || index >= METRICS_USB_ERRORS)
+    index = 0;
+  MetricsAdd(&metrics->usb_errors[index], 1);
+}
+
+// Has to be called by the thread itself
+void MetricsThreadStart(struct PadMetrics *metrics, int thread) {
+  if (pthread_getcpuclockid(pthread_self(), &metrics->cpu_clock[thread]) == 0)
+    __atomic_store_n(&metrics->cpu_clock_valid[thread], 1, __ATOMIC_RELEASE);
+}
+
+void MetricsThreadStop(struct PadMetrics *metrics, int thread) {
+  __atomic_store_n(&metrics->cpu_clock_valid[thread], 0, __ATOMIC_RELEASE);
+}
+
+static int64_t MetricsNowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Listens for scrapes on the Unix socket "path". Returns -1 on error.
+int MetricsServerOpen(const char *path) {
+  struct sockaddr_un addr;
+  int i;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // Socket may be left over from a previous run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, METRICS_MAX_CLIENTS) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+    metrics_clients[i] = -1;
+  metrics_fd = fd;
+  strcpy(metrics_path, path);
+  return 0;
+}
+
+// Stops listening and removes the socket
+void MetricsServerClose() {
+  int i;
+
+  if (metrics_fd < 0)
+    return;
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    if (metrics_clients[i] >= 0)
+      close(metrics_clients[i]);
+  }
+  close(metrics_fd);
+  metrics_fd = -1;
+  unlink(metrics_path);
+}
+
+// Adds the server sockets to "fds" and returns the new highest fd
+int MetricsServerFdSet(fd_set *fds, int maxfd) {
+  int i;
+
+  if (metrics_fd < 0)
+    return maxfd;
+
+  FD_SET(metrics_fd, fds);
+  if (metrics_fd > maxfd)
+    maxfd = metrics_fd;
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    if (metrics_clients[i] >= 0) {
+      FD_SET(metrics_clients[i], fds);
+      if (metrics_clients[i] > maxfd)
+        maxfd = metrics_clients[i];
+    }
+  }
+  return maxfd;
+}
+
+// Milliseconds until the next idle client has to be dropped, -1 if there
+// is none. The caller has to call MetricsServerHandle by then.
+int MetricsServerTimeout() {
+  int64_t now = MetricsNowMs();
+  int64_t timeout = -1;
+  int i;
+
+  if (metrics_fd < 0)
+    return -1;
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    if (metrics_clients[i] >= 0) {
+      int64_t remaining = metrics_client_since[i] + METRICS_CLIENT_TIMEOUT_MS - now;
+      if (remaining < 0)
+        remaining = 0;
+      if (timeout < 0 || remaining < timeout)
+        timeout = remaining;
+    }
+  }
+  return timeout;
+}
+
+// Answers any request with the current counters over HTTP/1.0
+static void MetricsServeClient(int fd) {
+  char request[1024];
+  char header[128];
+
+  if (read(fd, request, sizeof(request)) <= 0)
+    return;
+
+  int length = PadMetricsRender(metrics_buffer, sizeof(metrics_buffer));
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %d\r\n\r\n", length);
+  iov[1].iov_base = metrics_buffer;
+  iov[1].iov_len = length;
+
+  // Fits into the socket buffer. A client which doesn't read gets cut off.
+  if (writev(fd, iov, 2) < 0)
+    syslog(LOG_WARNING, "Failed to send metrics");
+}
+
+// Accepts new scrapers, answers the ones which sent their request and drops
+// the ones which didn't in time. "fds" may be NULL if nothing is readable.
+void MetricsServerHandle(fd_set *fds) {
+  int64_t now = MetricsNowMs();
+  int oldest = 0;
+  int i;
+
+  if (metrics_fd < 0)
+    return;
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    if (metrics_clients[i] < 0)
+      continue;
+    if (fds && FD_ISSET(metrics_clients[i], fds))
+      MetricsServeClient(metrics_clients[i]);
+    else if (now - metrics_client_since[i] < METRICS_CLIENT_TIMEOUT_MS)
+      continue;
+    close(metrics_clients[i]);
+    metrics_clients[i] = -1;
+  }
+
+  if (fds && FD_ISSET(metrics_fd, fds)) {
+    int fd = accept(metrics_fd, NULL, NULL);
+    if (fd < 0)
+      return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // With all slots taken, the oldest client had the most time to send
+    // its request. Idle connections must not lock out scrapers.
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+      if (metrics_clients[i] < 0)
+        break;
+      if (metrics_client_since[i] < metrics_client_since[oldest])
+        oldest = i;
+    }
+    if (i == METRICS_MAX_CLIENTS) {
+      i = oldest;
+      close(metrics_clients[i]);
+    }
+    metrics_clients[i] = fd;
+    metrics_client_since[i] = now;
+  }
+}
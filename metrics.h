@@ -0,0 +1,75 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/select.h>
+
+// libusb error codes are counted by -code, everything else lands in [0]
+#define METRICS_USB_ERRORS 13
+
+// Threads of a pad with CPU time accounting
+#define METRICS_THREAD_USB     0
+#define METRICS_THREAD_RUMBLE  1
+#define METRICS_THREAD_OUTPUT  2
+#define METRICS_THREADS        3
+
+#define METRICS_CACHE_LINE 64
+
+// Counters of one pad. Each group has exactly one writer at a time and gets
+// its own cache line, so counting never bounces lines between threads. The
+// metrics server reads everything with relaxed atomic loads.
+struct PadMetrics {
+  // Written by the USB thread
+  uint64_t reports __attribute__((aligned(METRICS_CACHE_LINE)));
+  uint64_t short_reports;
+  uint64_t read_timeouts;
+  uint64_t usb_errors[METRICS_USB_ERRORS];
+
+  // Written by whoever sends frames (serialized by output_lock if capped)
+  uint64_t uinput_events __attribute__((aligned(METRICS_CACHE_LINE)));
+  uint64_t uinput_writes;
+
+  // Written by the rumble thread
+  uint64_t ff_uploads __attribute__((aligned(METRICS_CACHE_LINE)));
+  uint64_t ff_plays;
+
+  // Set up by each thread for itself, cleared by whoever joins it
+  clockid_t cpu_clock[METRICS_THREADS] __attribute__((aligned(METRICS_CACHE_LINE)));
+  int cpu_clock_valid[METRICS_THREADS];
+};
+
+// Counting for single writers. A plain load and store is enough and avoids
+// the locked instruction of an atomic add.
+static inline void MetricsAdd(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t MetricsGet(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void MetricsUSBError(struct PadMetrics *metrics, int error);
+void MetricsThreadStart(struct PadMetrics *metrics, int thread);
+void MetricsThreadStop(struct PadMetrics *metrics, int thread);
+
+int MetricsServerOpen(const char *path);
+void MetricsServerClose();
+int MetricsServerFdSet(fd_set *fds, int maxfd);
+int MetricsServerTimeout();
+void MetricsServerHandle(fd_set *fds);
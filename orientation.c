@@ -0,0 +1,112 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "orientation.h"
+
+// Feedback gains (Q16)
+#define MAHONY_KP (2 << 16)
+#define MAHONY_KI (65536 / 200)
+
+// Multiplies two Q30 values
+static inline int32_t MulQ30(int32_t a, int32_t b) {
+  return ((int64_t)a * b) >> 30;
+}
+
+static uint32_t ISqrt64(uint64_t value) {
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+
+  while (bit > value)
+    bit >>= 2;
+  while (bit) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    }
+    else
+      result >>= 1;
+    bit >>= 2;
+  }
+  return result;
+}
+
+void OrientationInit(struct Orientation *o) {
+  memset(o, 0, sizeof(struct Orientation));
+  o->q[0] = ORIENTATION_ONE;
+}
+
+// Feeds one motion sample into the filter. "dt_us" is the time since the
+// previous sample in microseconds.
+void OrientationUpdate(struct Orientation *o, const struct MotionMsg *motion, int dt_us) {
+  int32_t *q = o->q;
+  int32_t g[3];
+  int32_t v[3];
+  int i;
+
+  // Direction of gravity as expected from the current orientation
+  v[0] = 2 * (MulQ30(q[1], q[3]) - MulQ30(q[0], q[2]));
+  v[1] = 2 * (MulQ30(q[0], q[1]) + MulQ30(q[2], q[3]));
+  v[2] = MulQ30(q[0], q[0]) - MulQ30(q[1], q[1]) - MulQ30(q[2], q[2]) + MulQ30(q[3], q[3]);
+
+  for (i = 0; i < 3; i++)
+    g[i] = motion->gyro[i];
+
+  // Correct gyro drift with the measured direction of gravity
+  const int32_t *a = motion->accl;
+  uint32_t norm = ISqrt64((int64_t)a[0] * a[0] + (int64_t)a[1] * a[1] + (int64_t)a[2] * a[2]);
+  if (norm) {
+    int32_t an[3];
+    int32_t e[3];
+    for (i = 0; i < 3; i++)
+      an[i] = ((int64_t)a[i] << 30) / norm;
+
+    e[0] = MulQ30(an[1], v[2]) - MulQ30(an[2], v[1]);
+    e[1] = MulQ30(an[2], v[0]) - MulQ30(an[0], v[2]);
+    e[2] = MulQ30(an[0], v[1]) - MulQ30(an[1], v[0]);
+
+    for (i = 0; i < 3; i++) {
+      o->integral[i] += ((int64_t)e[i] * MAHONY_KI * dt_us / 1000000) >> 30;
+      g[i] += (((int64_t)e[i] * MAHONY_KP) >> 30) + o->integral[i];
+    }
+  }
+
+  // Half rotation angle of this step in Q30
+  int32_t d[3];
+  for (i = 0; i < 3; i++)
+    d[i] = (int64_t)g[i] * dt_us * 8192 / 1000000;
+
+  int32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+  q[0] = q0 - MulQ30(q1, d[0]) - MulQ30(q2, d[1]) - MulQ30(q3, d[2]);
+  q[1] = q1 + MulQ30(q0, d[0]) + MulQ30(q2, d[2]) - MulQ30(q3, d[1]);
+  q[2] = q2 + MulQ30(q0, d[1]) - MulQ30(q1, d[2]) + MulQ30(q3, d[0]);
+  q[3] = q3 + MulQ30(q0, d[2]) + MulQ30(q1, d[1]) - MulQ30(q2, d[0]);
+
+  // Renormalize. The length is always close to one, so one Newton step
+  // for 1/sqrt(n) around 1 is enough.
+  int64_t n = (int64_t)q[0] * q[0] + (int64_t)q[1] * q[1] +
+              (int64_t)q[2] * q[2] + (int64_t)q[3] * q[3];
+  int32_t inv = ((3LL << 30) - (n >> 30)) >> 1;
+  for (i = 0; i < 4; i++)
+    q[i] = MulQ30(q[i], inv);
+
+  // Remove gravity from the measured acceleration
+  for (i = 0; i < 3; i++)
+    o->linear[i] = a[i] - (v[i] >> 16);
+}
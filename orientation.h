@@ -0,0 +1,38 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Fixed point Mahony style orientation filter for controllers with IMU.
+// Quaternion and unit vectors are Q30, angular rates are rad/s in Q16 and
+// accelerations are in g in Q14.
+#define ORIENTATION_ONE      (1 << 30)
+#define ORIENTATION_G        (1 << 14)
+
+// Motion sample in device independent units
+struct MotionMsg {
+  int32_t gyro[3];      // rad/s, Q16
+  int32_t accl[3];      // g, Q14
+};
+
+struct Orientation {
+  int32_t q[4];         // w, x, y, z (Q30)
+  int32_t integral[3];  // Integral feedback (rad/s, Q16)
+  int32_t linear[3];    // Gravity removed acceleration (g, Q14)
+};
+
+void OrientationInit(struct Orientation *o);
+void OrientationUpdate(struct Orientation *o, const struct MotionMsg *motion, int dt_us);
@@ -0,0 +1,169 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "usb.h"
+#include "uinput.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "latency-probe.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "pad.h"
+#include "output.h"
+
+// Writes one frame to uinput. In capped modes the caller holds output_lock.
+static void SendFrame(struct Pad *pad, const struct XpadMsg *msg, int has_usec, uint32_t usec) {
+  struct UinputFrame frame;
+  UinputFrameInit(&frame);
+
+  if (has_usec) {
+    if (pad->probe) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      LatencyProbeFrameWritten(pad->probe, usec, &now);
+    }
+    UinputFrameAddTimestamp(&frame, usec);
+  }
+  UinputFrameAddXpadMsg(&frame, pad->profile, msg);
+  MetricsAdd(&pad->metrics.uinput_events, frame.count + 1);  // With SYN_REPORT
+  MetricsAdd(&pad->metrics.uinput_writes, 1);
+  UinputFrameSend(pad->fduinput, &frame);
+
+  pad->last_sent = *msg;
+  pad->frames_out++;
+}
+
+// Sends the pending frame if there is one
+static void FlushPending(struct Pad *pad) {
+  if (pad->pending_valid) {
+    SendFrame(pad, &pad->pending, pad->pending_has_usec, pad->pending_usec);
+    pad->pending_valid = 0;
+  }
+}
+
+// Sends the latest state on each timer tick
+static void *DeviceHandlerThreadOutput(void *attr) {
+  struct Pad *pad = (struct Pad *)attr;
+  uint64_t expirations;
+
+  MetricsThreadStart(&pad->metrics, METRICS_THREAD_OUTPUT);
+  while (read(pad->fdtimer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    // write() to uinput is a cancellation point, don't get cancelled
+    // while holding the output lock
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&pad->output_lock);
+    FlushPending(pad);
+    pthread_mutex_unlock(&pad->output_lock);
+    pthread_setcancelstate(oldstate, NULL);
+  }
+
+  return NULL;
+}
+
+// Sets up the output policy of a controller. Capped modes get a timerfd and
+// a thread which flushes the latest state at the configured rate.
+int OutputStart(struct Pad *pad) {
+  pthread_mutex_init(&pad->output_lock, NULL);
+  pad->fdtimer = -1;
+
+  if (pad->output_policy == OUTPUT_ALL || pad->output_hz <= 0) {
+    pad->output_policy = OUTPUT_ALL;
+    return 0;
+  }
+
+  pad->fdtimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (pad->fdtimer < 0) {
+    pad->output_policy = OUTPUT_ALL;
+    return -1;
+  }
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  long interval_ns = 1000000000L / pad->output_hz;
+  its.it_interval.tv_sec = interval_ns / 1000000000L;
+  its.it_interval.tv_nsec = interval_ns % 1000000000L;
+  its.it_value = its.it_interval;
+  int ret = timerfd_settime(pad->fdtimer, 0, &its, NULL);
+
+  pthread_attr_t tattr;
+  if (ret == 0 && PadThreadAttrInit(&tattr) == 0) {
+    ret = pthread_create(&pad->tid_output, &tattr, &DeviceHandlerThreadOutput, (void *)pad);
+    pthread_attr_destroy(&tattr);
+  }
+  else
+    ret = -1;
+  if (ret != 0) {
+    close(pad->fdtimer);
+    pad->fdtimer = -1;
+    pad->output_policy = OUTPUT_ALL;
+    return -1;
+  }
+
+  pad->threads++;
+  return 0;
+}
+
+void OutputStop(struct Pad *pad) {
+  if (pad->fdtimer >= 0) {
+    pthread_cancel(pad->tid_output);
+    pthread_join(pad->tid_output, NULL);
+    MetricsThreadStop(&pad->metrics, METRICS_THREAD_OUTPUT);
+    close(pad->fdtimer);
+    pad->fdtimer = -1;
+  }
+  pthread_mutex_destroy(&pad->output_lock);
+}
+
+// Passes one decoded frame on according to the output policy
+void OutputFrame(struct Pad *pad, const struct XpadMsg *msg, int has_usec, uint32_t usec) {
+  pad->frames_in++;
+
+  if (pad->output_policy == OUTPUT_ALL) {
+    SendFrame(pad, msg, has_usec, usec);
+    return;
+  }
+
+  pthread_mutex_lock(&pad->output_lock);
+  if (pad->output_policy == OUTPUT_CAP_AXES && XpadButtonsChanged(msg, &pad->last_sent)) {
+    // Button edges go out immediately, together with the current axes
+    pad->pending_valid = 0;
+    SendFrame(pad, msg, has_usec, usec);
+  }
+  else {
+    // Never let a button change get overwritten before it was sent
+    if (pad->pending_valid &&
+        XpadButtonsChanged(&pad->pending, &pad->last_sent) &&
+        XpadButtonsChanged(msg, &pad->pending))
+      FlushPending(pad);
+
+    pad->pending = *msg;
+    pad->pending_has_usec = has_usec;
+    pad->pending_usec = usec;
+    pad->pending_valid = 1;
+  }
+  pthread_mutex_unlock(&pad->output_lock);
+}
@@ -0,0 +1,28 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// How frames get from the decoder to uinput
+#define OUTPUT_ALL        0  // Every decoded report is sent
+#define OUTPUT_CAP        1  // At most "output_hz" frames, latest state wins
+#define OUTPUT_CAP_AXES   2  // Like OUTPUT_CAP, but button changes go out at once
+
+struct Pad;
+
+int OutputStart(struct Pad *pad);
+void OutputStop(struct Pad *pad);
+void OutputFrame(struct Pad *pad, const struct XpadMsg *msg, int has_usec, uint32_t usec);
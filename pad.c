@@ -0,0 +1,514 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include "usb.h"
+#include "uinput.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "latency-probe.h"
+#include "device-types.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "pad.h"
+
+static pthread_mutex_t pad_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Pad *pads_used = NULL;  // All attached controllers
+static struct Pad *pads_free = NULL;  // Unused slab entries
+static struct Pad *pad_slab = NULL;
+static int pad_slab_count = 0;
+static size_t pad_stack_size = 0;     // 0 = pthread default
+static uint64_t pads_attached = 0;
+static uint64_t pads_detached = 0;
+
+// Labels of the USBOutput paths
+static const char *rumble_paths[2] = {"interrupt", "control"};
+
+// Process start, for the time until the very first report
+static struct timespec start_time;
+static int have_first_report = 0;
+
+// Time from the udev event to the first report of a controller
+static uint64_t attach_latency_count = 0;
+static int64_t attach_latency_sum_ns = 0;
+static int64_t attach_latency_max_ns = 0;
+
+// Resource usage the first time all controllers were gone. Whenever the
+// last controller goes away again, we should be back there.
+#define IDLE_RSS_GROWTH_KIB 1024
+static int idle_check_pending = 0;
+static int have_idle_usage = 0;
+static struct ProcessUsage idle_usage;
+
+// Sets up the low footprint mode. If "slab_pads" is nonzero, state for this
+// many controllers is allocated right now and no further controllers are
+// accepted. A nonzero "stack_size" is used for all controller threads.
+int PadSetup(int slab_pads, size_t stack_size) {
+  int i;
+
+  pad_stack_size = stack_size;
+
+  if (slab_pads > 0) {
+    // Keeps the metrics of each pad on their own cache lines
+    if (posix_memalign((void **)&pad_slab, METRICS_CACHE_LINE, slab_pads * sizeof(struct Pad)) != 0)
+      return -1;
+    memset(pad_slab, 0, slab_pads * sizeof(struct Pad));
+    pad_slab_count = slab_pads;
+    for (i = slab_pads - 1; i >= 0; i--) {
+      pad_slab[i].next = pads_free;
+      pads_free = &pad_slab[i];
+    }
+  }
+
+  return 0;
+}
+
+// Returns a new, zeroed controller state or NULL if none is available
+struct Pad *PadAlloc() {
+  struct Pad *pad;
+
+  pthread_mutex_lock(&pad_lock);
+  if (pad_slab) {
+    pad = pads_free;
+    if (pad)
+      pads_free = pad->next;
+  }
+  else if (posix_memalign((void **)&pad, METRICS_CACHE_LINE, sizeof(struct Pad)) != 0)
+    pad = NULL;
+
+  if (pad) {
+    memset(pad, 0, sizeof(struct Pad));
+    pad->fduinput = -1;
+    pad->fdmotion = -1;
+    pad->fdtimer = -1;
+    pad->next = pads_used;
+    pads_used = pad;
+    pads_attached++;
+  }
+  pthread_mutex_unlock(&pad_lock);
+
+  return pad;
+}
+
+void PadFree(struct Pad *pad) {
+  struct Pad **iter;
+
+  pthread_mutex_lock(&pad_lock);
+  for (iter = &pads_used; *iter; iter = &(*iter)->next) {
+    if (*iter == pad) {
+      *iter = pad->next;
+      pads_detached++;
+      break;
+    }
+  }
+  if (pads_used == NULL)
+    idle_check_pending = 1;
+
+  if (pad_slab) {
+    pad->next = pads_free;
+    pads_free = pad;
+  }
+  else
+    free(pad);
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Prepares thread attributes for controller threads. The caller has to
+// destroy "tattr" after use.
+int PadThreadAttrInit(pthread_attr_t *tattr) {
+  if (pthread_attr_init(tattr) != 0)
+    return -1;
+
+  if (pad_stack_size && pthread_attr_setstacksize(tattr, pad_stack_size) != 0) {
+    pthread_attr_destroy(tattr);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Reads resident memory, thread and file descriptor count of our process
+int PadGetProcessUsage(struct ProcessUsage *usage) {
+  FILE *file;
+  char line[128];
+  long size, pages;
+
+  file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return -1;
+  if (fscanf(file, "%ld %ld", &size, &pages) != 2) {
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  usage->rss_kib = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+  usage->threads = 0;
+  file = fopen("/proc/self/status", "r");
+  if (file == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "Threads: %d", &usage->threads) == 1)
+      break;
+  }
+  fclose(file);
+
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL)
+    return -1;
+  usage->fds = 0;
+  while (readdir(dir))
+    usage->fds++;
+  closedir(dir);
+  usage->fds -= 3; // ".", ".." and the fd of "dir" itself
+
+  return 0;
+}
+
+// Writes the resources used by each controller to syslog
+void PadAccountingReport() {
+  struct ProcessUsage usage;
+  struct Pad *pad;
+  size_t stack_size = pad_stack_size;
+
+  if (!stack_size) {
+    pthread_attr_t tattr;
+    pthread_attr_init(&tattr);
+    pthread_attr_getstacksize(&tattr, &stack_size);
+    pthread_attr_destroy(&tattr);
+  }
+
+  if (PadGetProcessUsage(&usage) == 0)
+    syslog(LOG_INFO, "Process: RSS %ld KiB, %d threads, %d fds",
+           usage.rss_kib, usage.threads, usage.fds);
+
+  UinputProfilesReport();
+
+  if (pad_slab)
+    syslog(LOG_INFO, "Slab: %d controllers, %zu bytes",
+           pad_slab_count, pad_slab_count * sizeof(struct Pad));
+
+  pthread_mutex_lock(&pad_lock);
+  if (attach_latency_count)
+    syslog(LOG_INFO, "Attach to first report: %llu controllers, avg %lld ms, max %lld ms",
+           (unsigned long long)attach_latency_count,
+           (long long)(attach_latency_sum_ns / attach_latency_count / 1000000),
+           (long long)(attach_latency_max_ns / 1000000));
+
+  for (pad = pads_used; pad; pad = pad->next) {
+    // uinput devices, the usbfs device node, the evdev node of the probe
+    // and the output timer
+    int fds = (pad->fduinput >= 0) + (pad->fdmotion >= 0) + (pad->usbdev != NULL) +
+              (pad->probe != NULL) + (pad->fdtimer >= 0);
+    syslog(LOG_INFO, "Controller %03d/%03d (%s): %d threads (%zu KiB stack each), %d fds, %zu bytes state",
+           pad->args.busnum, pad->args.devnum, pad->args.type->name,
+           pad->threads, stack_size / 1024, fds, sizeof(struct Pad));
+
+    struct TimeSync *ts = &pad->timesync;
+    if (ts->samples)
+      syslog(LOG_INFO, "Controller %03d/%03d: clock drift %.1f ppm, queuing delay avg %lld us, max %lld us",
+             pad->args.busnum, pad->args.devnum, ts->drift_ppb / 1000.0,
+             (long long)(ts->delay_sum_ns / ts->samples / 1000),
+             (long long)(ts->delay_max_ns / 1000));
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - pad->attach_time.tv_sec) +
+                     (now.tv_nsec - pad->attach_time.tv_nsec) / 1e9;
+    if (elapsed > 0)
+      syslog(LOG_INFO, "Controller %03d/%03d: input %.1f Hz (%.1f Hz decoded), output %.1f Hz",
+             pad->args.busnum, pad->args.devnum, pad->metrics.reports / elapsed,
+             pad->frames_in / elapsed, pad->frames_out / elapsed);
+
+    if (pad->incidents || pad->metrics.short_reports)
+      syslog(LOG_INFO, "Controller %03d/%03d: %llu short reports, %llu read timeouts, %lu USB incidents, %lu recovered (avg %lld ms, max %lld ms)",
+             pad->args.busnum, pad->args.devnum, (unsigned long long)pad->metrics.short_reports,
+             (unsigned long long)pad->metrics.read_timeouts, pad->incidents, pad->recoveries,
+             (long long)(pad->recoveries ? pad->recovery_sum_ns / pad->recoveries / 1000000 : 0),
+             (long long)(pad->recovery_max_ns / 1000000));
+
+    int path;
+    for (path = 0; path < 2; path++) {
+      struct USBOutput *out = &pad->output;
+      if (out->sent[path] || out->failed[path])
+        syslog(LOG_INFO, "Controller %03d/%03d: rumble over %s pipe: %llu sent, %llu failed, latency avg %lld us, max %lld us",
+               pad->args.busnum, pad->args.devnum, rumble_paths[path],
+               (unsigned long long)out->sent[path], (unsigned long long)out->failed[path],
+               (long long)(out->sent[path] ? out->latency_sum_ns[path] / out->sent[path] / 1000 : 0),
+               (long long)(out->latency_max_ns[path] / 1000));
+    }
+
+    if (pad->probe) {
+      char name[32];
+      snprintf(name, sizeof(name), "Controller %03d/%03d", pad->args.busnum, pad->args.devnum);
+      LatencyProbeReport(pad->probe, name);
+    }
+
+    // Estimate saved time from the average cost of a decoded report
+    unsigned long long reports = pad->metrics.reports;
+    unsigned long long unchanged = pad->reports_unchanged;
+    unsigned long long decoded = reports - unchanged;
+    if (reports && decoded)
+      syslog(LOG_INFO, "Controller %03d/%03d: %llu reports, %llu unchanged (%llu%%), ~%llu us CPU saved",
+             pad->args.busnum, pad->args.devnum, reports, unchanged, unchanged * 100 / reports,
+             (unsigned long long)(pad->decode_ns / decoded * unchanged / 1000));
+  }
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Dumps the flight recorder of each controller
+void PadDumpFlightRecorders() {
+  struct Pad *pad;
+
+  pthread_mutex_lock(&pad_lock);
+  for (pad = pads_used; pad; pad = pad->next)
+    FlightRecorderDump(&pad->recorder);
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Publishes a new latency probe for a controller and returns the old one.
+// Reports read the probe under pad_lock, so it has to be swapped under the
+// lock before the old one is stopped and freed.
+struct LatencyProbe *PadSwapProbe(struct Pad *pad, struct LatencyProbe *probe) {
+  struct LatencyProbe *old;
+
+  pthread_mutex_lock(&pad_lock);
+  old = pad->probe;
+  pad->probe = probe;
+  pthread_mutex_unlock(&pad_lock);
+  return old;
+}
+
+// Unmaps the flight recorder of a controller. Takes pad_lock so a dump
+// requested through SIGUSR2 never reads a ring that is being unmapped.
+void PadCloseFlightRecorder(struct Pad *pad, int keep) {
+  pthread_mutex_lock(&pad_lock);
+  FlightRecorderClose(&pad->recorder, keep);
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Tells the handler of a controller which udev reported as removed to quit,
+// no matter what state it is in
+void PadRemoved(int busnum, int devnum) {
+  struct Pad *pad;
+
+  pthread_mutex_lock(&pad_lock);
+  for (pad = pads_used; pad; pad = pad->next) {
+    if (pad->args.busnum == busnum && pad->args.devnum == devnum)
+      __atomic_store_n(&pad->removed, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Accounts the attach latency of a controller
+void PadFirstReport(struct Pad *pad, const struct timespec *now) {
+  int64_t latency = (now->tv_sec - pad->attach_time.tv_sec) * 1000000000LL +
+                    (now->tv_nsec - pad->attach_time.tv_nsec);
+
+  syslog(LOG_DEBUG, "Controller %03d/%03d: first report %lld us after attach",
+         pad->args.busnum, pad->args.devnum, (long long)(latency / 1000));
+
+  pthread_mutex_lock(&pad_lock);
+  if (!have_first_report) {
+    have_first_report = 1;
+    syslog(LOG_INFO, "Cold start to first report: %lld ms",
+           (long long)(((now->tv_sec - start_time.tv_sec) * 1000000000LL +
+                        (now->tv_nsec - start_time.tv_nsec)) / 1000000));
+  }
+  attach_latency_count++;
+  attach_latency_sum_ns += latency;
+  if (latency > attach_latency_max_ns)
+    attach_latency_max_ns = latency;
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Remembers when the process started. Called first thing in main.
+void PadSetStartTime() {
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+// Returns the number of attached controllers
+int PadCount() {
+  struct Pad *pad;
+  int count = 0;
+
+  pthread_mutex_lock(&pad_lock);
+  for (pad = pads_used; pad; pad = pad->next)
+    count++;
+  pthread_mutex_unlock(&pad_lock);
+  return count;
+}
+
+// Returns nonzero if the last controller went away recently. The check has
+// to wait until the handler threads are gone.
+int PadIdleCheckPending() {
+  pthread_mutex_lock(&pad_lock);
+  int pending = idle_check_pending;
+  pthread_mutex_unlock(&pad_lock);
+  return pending;
+}
+
+// Compares resource usage to the last time no controller was attached.
+// Anything left behind by a controller shows up as growth here.
+void PadIdleCheck() {
+  struct ProcessUsage usage;
+
+  pthread_mutex_lock(&pad_lock);
+  int idle = (pads_used == NULL);
+  idle_check_pending = 0;
+  pthread_mutex_unlock(&pad_lock);
+
+  if (!idle || PadGetProcessUsage(&usage) < 0)
+    return;
+
+  if (!have_idle_usage) {
+    idle_usage = usage;
+    have_idle_usage = 1;
+    return;
+  }
+
+  if (usage.fds > idle_usage.fds || usage.threads > idle_usage.threads ||
+      usage.rss_kib > idle_usage.rss_kib + IDLE_RSS_GROWTH_KIB)
+    syslog(LOG_WARNING, "Resources grew after %llu attach cycles: RSS %ld -> %ld KiB, %d -> %d threads, %d -> %d fds",
+           (unsigned long long)pads_detached, idle_usage.rss_kib, usage.rss_kib,
+           idle_usage.threads, usage.threads, idle_usage.fds, usage.fds);
+}
+
+// Makes all handlers check their CPU placement again
+void PadAffinityChanged() {
+  struct Pad *pad;
+
+  pthread_mutex_lock(&pad_lock);
+  for (pad = pads_used; pad; pad = pad->next) {
+    if (pad->affinity)
+      __atomic_store_n(&pad->affinity_stale, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&pad_lock);
+}
+
+// Appends to a buffer, output beyond "size" gets dropped
+static void Append(char *buf, int size, int *length, const char *format, ...) {
+  va_list args;
+
+  if (*length >= size)
+    return;
+  va_start(args, format);
+  int n = vsnprintf(buf + *length, size - *length, format, args);
+  va_end(args);
+  *length = (n < 0 || *length + n > size) ? size : *length + n;
+}
+
+static const struct {
+  const char *name;
+  const char *help;
+  size_t offset;
+} pad_counters[] = {
+  {"reports", "Input reports received", offsetof(struct PadMetrics, reports)},
+  {"short_reports", "Input reports dropped for being too short", offsetof(struct PadMetrics, short_reports)},
+  {"read_timeouts", "Input reads which timed out", offsetof(struct PadMetrics, read_timeouts)},
+  {"uinput_events", "Events written to the gamepad device", offsetof(struct PadMetrics, uinput_events)},
+  {"uinput_writes", "Write syscalls to the gamepad device", offsetof(struct PadMetrics, uinput_writes)},
+  {"ff_uploads", "Force feedback effects uploaded", offsetof(struct PadMetrics, ff_uploads)},
+  {"ff_plays", "Force feedback effects played", offsetof(struct PadMetrics, ff_plays)}
+};
+
+static const char *pad_thread_names[METRICS_THREADS] = {"usb", "rumble", "output"};
+
+// Renders all counters in Prometheus text format. Returns the length.
+int PadMetricsRender(char *buf, int size) {
+  int length = 0;
+  struct Pad *pad;
+  int i, j;
+
+  pthread_mutex_lock(&pad_lock);
+  Append(buf, size, &length,
+         "# HELP pspaddrv_attach_total Controllers attached\n"
+         "# TYPE pspaddrv_attach_total counter\n"
+         "pspaddrv_attach_total %llu\n"
+         "# HELP pspaddrv_detach_total Controllers detached\n"
+         "# TYPE pspaddrv_detach_total counter\n"
+         "pspaddrv_detach_total %llu\n",
+         (unsigned long long)pads_attached, (unsigned long long)pads_detached);
+
+  for (i = 0; i < sizeof(pad_counters) / sizeof(pad_counters[0]); i++) {
+    Append(buf, size, &length, "# HELP pspaddrv_%s_total %s\n# TYPE pspaddrv_%s_total counter\n",
+           pad_counters[i].name, pad_counters[i].help, pad_counters[i].name);
+    for (pad = pads_used; pad; pad = pad->next) {
+      const uint64_t *counter = (const uint64_t *)((const char *)&pad->metrics + pad_counters[i].offset);
+      Append(buf, size, &length, "pspaddrv_%s_total{bus=\"%03d\",device=\"%03d\"} %llu\n",
+             pad_counters[i].name, pad->args.busnum, pad->args.devnum,
+             (unsigned long long)MetricsGet(counter));
+    }
+  }
+
+  Append(buf, size, &length, "# HELP pspaddrv_usb_errors_total Failed USB input reads by libusb error\n"
+                             "# TYPE pspaddrv_usb_errors_total counter\n");
+  for (pad = pads_used; pad; pad = pad->next) {
+    for (j = 0; j < METRICS_USB_ERRORS; j++) {
+      uint64_t count = MetricsGet(&pad->metrics.usb_errors[j]);
+      if (count)
+        Append(buf, size, &length, "pspaddrv_usb_errors_total{bus=\"%03d\",device=\"%03d\",code=\"%s\"} %llu\n",
+               pad->args.busnum, pad->args.devnum,
+               j ? USBErrorName(-j) : "LIBUSB_ERROR_OTHER", (unsigned long long)count);
+    }
+  }
+
+  // Rumble as the USB transfers completed, not as it was requested
+  Append(buf, size, &length, "# HELP pspaddrv_rumble_sent_total Rumble reports the controller accepted\n"
+                             "# TYPE pspaddrv_rumble_sent_total counter\n");
+  for (pad = pads_used; pad; pad = pad->next) {
+    for (j = 0; j < 2; j++)
+      Append(buf, size, &length, "pspaddrv_rumble_sent_total{bus=\"%03d\",device=\"%03d\",path=\"%s\"} %llu\n",
+             pad->args.busnum, pad->args.devnum, rumble_paths[j],
+             (unsigned long long)__atomic_load_n(&pad->output.sent[j], __ATOMIC_RELAXED));
+  }
+  Append(buf, size, &length, "# HELP pspaddrv_rumble_failed_total Rumble reports which failed to transfer\n"
+                             "# TYPE pspaddrv_rumble_failed_total counter\n");
+  for (pad = pads_used; pad; pad = pad->next) {
+    for (j = 0; j < 2; j++)
+      Append(buf, size, &length, "pspaddrv_rumble_failed_total{bus=\"%03d\",device=\"%03d\",path=\"%s\"} %llu\n",
+             pad->args.busnum, pad->args.devnum, rumble_paths[j],
+             (unsigned long long)__atomic_load_n(&pad->output.failed[j], __ATOMIC_RELAXED));
+  }
+
+  Append(buf, size, &length, "# HELP pspaddrv_thread_cpu_seconds_total CPU time of controller threads\n"
+                             "# TYPE pspaddrv_thread_cpu_seconds_total counter\n");
+  for (pad = pads_used; pad; pad = pad->next) {
+    for (j = 0; j < METRICS_THREADS; j++) {
+      struct timespec cpu;
+      if (!__atomic_load_n(&pad->metrics.cpu_clock_valid[j], __ATOMIC_ACQUIRE) ||
+          clock_gettime(pad->metrics.cpu_clock[j], &cpu) < 0)
+        continue;
+      Append(buf, size, &length, "pspaddrv_thread_cpu_seconds_total{bus=\"%03d\",device=\"%03d\",thread=\"%s\"} %ld.%09ld\n",
+             pad->args.busnum, pad->args.devnum, pad_thread_names[j],
+             (long)cpu.tv_sec, cpu.tv_nsec);
+    }
+  }
+  pthread_mutex_unlock(&pad_lock);
+
+  return length;
+}
@@ -0,0 +1,118 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Everything that belongs to one connected controller. In low footprint mode
+// these are taken from one preallocated slab, otherwise they get allocated
+// on attach.
+struct Pad {
+  struct Pad *next;
+  struct USBDeviceHandlerArgs args;
+
+  libusb_device_handle *usbdev;
+  struct USBOutput output;      // Rumble reports to the controller
+  const struct UinputProfile *profile;  // What the virtual device looks like
+  int fduinput;
+
+  int orientation;              // Publish orientation of devices with IMU
+  int fdmotion;
+  struct Orientation motion;
+  struct timespec motion_time;  // Time of the last motion sample
+
+  struct TimeSync timesync;     // Device against host clock
+
+  const char *plan_cache_dir;   // Where decode plans are cached (may be NULL)
+  int hid_plan;                 // Decode with the report descriptor
+  struct HIDPlan *plan;         // NULL = decode with type->decode
+
+  int latency_probe;            // Measure uinput->evdev latency
+  struct LatencyProbe *probe;
+
+  // Output policy (see output.h)
+  int output_policy;
+  int output_hz;
+  int fdtimer;
+  pthread_t tid_output;
+  pthread_mutex_t output_lock;
+  struct XpadMsg last_sent;
+  struct XpadMsg pending;       // Latest state not sent yet
+  int pending_valid;
+  int pending_has_usec;
+  uint32_t pending_usec;
+  unsigned long frames_in;      // Decoded frames
+  unsigned long frames_out;     // Frames written to uinput
+  struct timespec attach_time;  // When udev reported the controller
+  int removed;                  // Set when udev reports the controller gone
+
+  const char *recorder_dir;     // NULL = no flight recorder
+  struct FlightRecorder recorder;
+
+  // USB error recovery (see recovery.h)
+  int recovery_state;
+  int recovery_attempts;
+  int recovery_cause;           // libusb error which started the incident
+  struct timespec incident_start;
+  struct timespec last_report_time;
+  int report_interval_us;       // Smoothed time between reports
+  int report_streak;            // Reports since the last error
+  unsigned long incidents;
+  unsigned long recoveries;
+  int64_t recovery_sum_ns;
+  int64_t recovery_max_ns;
+
+  struct PadMetrics metrics;    // Counters for the metrics server
+
+  int affinity;                 // AFFINITY_* (see affinity.h)
+  int affinity_stale;           // Set on hotplug, handler pins itself again
+  char affinity_desc[64];       // Where the handler runs now
+
+  int threads;                  // Number of running threads for this pad
+  pthread_t tid_rumble;
+
+  unsigned char report[USB_MAX_REPORT_SIZE];
+  unsigned char last_report[USB_MAX_REPORT_SIZE];  // Last decoded report
+  int have_last_report;
+
+  // Statistics for the unchanged report fast path
+  unsigned long reports_unchanged;
+  uint64_t decode_ns;           // Time spent in decoding and sending
+};
+
+// Process wide resource usage as measured from /proc
+struct ProcessUsage {
+  long rss_kib;
+  int threads;
+  int fds;
+};
+
+int PadSetup(int slab_pads, size_t stack_size);
+struct Pad *PadAlloc();
+void PadFree(struct Pad *pad);
+int PadThreadAttrInit(pthread_attr_t *tattr);
+int PadGetProcessUsage(struct ProcessUsage *usage);
+void PadAccountingReport();
+void PadDumpFlightRecorders();
+void PadCloseFlightRecorder(struct Pad *pad, int keep);
+struct LatencyProbe *PadSwapProbe(struct Pad *pad, struct LatencyProbe *probe);
+int PadMetricsRender(char *buf, int size);
+void PadAffinityChanged();
+void PadRemoved(int busnum, int devnum);
+void PadFirstReport(struct Pad *pad, const struct timespec *now);
+int PadIdleCheckPending();
+void PadIdleCheck();
+int PadCount();
+void PadSetStartTime();
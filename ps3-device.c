@@ -19,9 +19,11 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "usb.h"
 #include "uinput.h"
+#include "device-types.h"
 #include "ps3-device.h"
 
 #define SIXAXIS_REPORT_0xF2_SIZE 17
@@ -113,6 +115,13 @@ struct Playstation3USBMsg {
 } __attribute__((__packed__));
 
 
+// Buttons, sticks and analog triggers
+static const unsigned char ps3_input_mask[USB_MAX_REPORT_SIZE] = {
+  [2] = 0xff, [3] = 0xff, [4] = 0x01,
+  [6] = 0xff, [7] = 0xff, [8] = 0xff, [9] = 0xff,
+  [18] = 0xff, [19] = 0xff
+};
+
 /*
  * Sending HID_REQ_GET_REPORT changes the operation mode of the ps3 controller
  * to "operational".  Without this, the ps3 controller will not report any
@@ -124,14 +133,8 @@ int PS3SetOperationalUSB(libusb_device_handle *usbdev) {
 
   printf("    REQUEST: Get_Report >> 0x%04x\n", (HID_FEATURE_REPORT<<8)|0xf2);
 
-  ret = libusb_control_transfer(usbdev,
-                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-                        HID_REQ_GET_REPORT,
-                        (HID_FEATURE_REPORT<<8)|0xf2,
-                        0,
-                        buf,
-                        SIXAXIS_REPORT_0xF2_SIZE,
-                        USB_CTRL_GET_TIMEOUT);
+  ret = USBGetReport(usbdev, HID_FEATURE_REPORT, 0xf2,
+                     buf, SIXAXIS_REPORT_0xF2_SIZE);
 
   if (ret == 0) {
     printf("    SUCCESS: Data <<");
@@ -144,75 +147,79 @@ int PS3SetOperationalUSB(libusb_device_handle *usbdev) {
   return ret;
 }
 
-int PS3PollInputUSB(libusb_device_handle *usbdev, struct XpadMsg *msg_out) {
-  struct Playstation3USBMsg ps3msg;
-  int transferred;
-  int ret = libusb_interrupt_transfer(usbdev,
-                                      SIXAXIS_ENDPOINT_IN,
-                                      (unsigned char*)&ps3msg, sizeof(ps3msg),
-                                      &transferred, USB_CTRL_GET_TIMEOUT);
-  if (ret < 0) {
-    // Timeout --> User still has to press PS button
-    if (ret == LIBUSB_ERROR_TIMEOUT)
-      return 0;
-
-    return ret;
-  }
-
-  msg_out->btn_a = ps3msg.btn_cross;
-  msg_out->btn_b = ps3msg.btn_circle;
-  msg_out->btn_x = ps3msg.btn_square;
-  msg_out->btn_y = ps3msg.btn_triangle;
-  msg_out->btn_start = ps3msg.btn_start;
-  msg_out->btn_select = ps3msg.btn_select;
-  msg_out->btn_guide = ps3msg.btn_playstation;
-  msg_out->btn_ls = ps3msg.btn_l3;
-  msg_out->btn_rs = ps3msg.btn_r3;
-  msg_out->btn_lb = ps3msg.btn_l1;
-  msg_out->btn_rb = ps3msg.btn_r1;
-  msg_out->abs_lt = ps3msg.abs_l2;
-  msg_out->abs_rt = ps3msg.abs_r2;
-  msg_out->abs_lx = ps3msg.abs_lx;
-  msg_out->abs_ly = ps3msg.abs_ly;
-  msg_out->abs_rx = ps3msg.abs_rx;
-  msg_out->abs_ry = ps3msg.abs_ry;
-
-  if (ps3msg.btn_dpad_up)
+void PS3DecodeInput(const unsigned char *report, struct XpadMsg *msg_out) {
+  const struct Playstation3USBMsg *ps3msg = (const struct Playstation3USBMsg *)report;
+
+  msg_out->buttons = (ps3msg->btn_cross ? XPAD_BTN_A : 0) |
+                     (ps3msg->btn_circle ? XPAD_BTN_B : 0) |
+                     (ps3msg->btn_square ? XPAD_BTN_X : 0) |
+                     (ps3msg->btn_triangle ? XPAD_BTN_Y : 0) |
+                     (ps3msg->btn_start ? XPAD_BTN_START : 0) |
+                     (ps3msg->btn_select ? XPAD_BTN_SELECT : 0) |
+                     (ps3msg->btn_playstation ? XPAD_BTN_GUIDE : 0) |
+                     (ps3msg->btn_l3 ? XPAD_BTN_LS : 0) |
+                     (ps3msg->btn_r3 ? XPAD_BTN_RS : 0) |
+                     (ps3msg->btn_l1 ? XPAD_BTN_LB : 0) |
+                     (ps3msg->btn_r1 ? XPAD_BTN_RB : 0);
+  msg_out->abs_lt = ps3msg->abs_l2;
+  msg_out->abs_rt = ps3msg->abs_r2;
+  msg_out->abs_lx = ps3msg->abs_lx;
+  msg_out->abs_ly = ps3msg->abs_ly;
+  msg_out->abs_rx = ps3msg->abs_rx;
+  msg_out->abs_ry = ps3msg->abs_ry;
+
+  if (ps3msg->btn_dpad_up)
     msg_out->abs_dy = -1;
-  else if (ps3msg.btn_dpad_down)
+  else if (ps3msg->btn_dpad_down)
     msg_out->abs_dy = 1;
   else
     msg_out->abs_dy = 0;
-  if (ps3msg.btn_dpad_left)
+  if (ps3msg->btn_dpad_left)
     msg_out->abs_dx = -1;
-  else if (ps3msg.btn_dpad_right)
+  else if (ps3msg->btn_dpad_right)
     msg_out->abs_dx = 1;
   else
     msg_out->abs_dx = 0;
-
-  return 0;
 }
 
-int PS3SendRumbleUSB(libusb_device_handle *usbdev, int weak, int strong) {
-  uint8_t left = strong / 256;
-  uint8_t right = weak ? 1 : 0;
-
-  uint8_t cmd[] = {
-    0x00, 254, right, 254, left,  // rumble values
-    0x00, 0x00, 0x00, 0x00, 0x03,   // 0x10=LED1 .. 0x02=LED4
-    0xff, 0x27, 0x10, 0x00, 0x32,   // LED 4
-    0xff, 0x27, 0x10, 0x00, 0x32,   // LED 3
-    0xff, 0x27, 0x10, 0x00, 0x32,   // LED 2
-    0xff, 0x27, 0x10, 0x00, 0x32,   // LED 1
-    0x00, 0x00, 0x00, 0x00, 0x00
-  };
-
-  return libusb_control_transfer(usbdev,
-                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-                        HID_REQ_SET_REPORT,
-                        (HID_OUTPUT_REPORT<<8)|0x01,
-                        0,
-                        cmd,
-                        sizeof(cmd),
-                        USB_CTRL_GET_TIMEOUT);
+// Output report 0x01. Only the rumble values get patched on each update.
+static const unsigned char ps3_output_report[] = {
+  0x01,                           // report ID
+  0x00, 254, 0x00, 254, 0x00,     // rumble values
+  0x00, 0x00, 0x00, 0x00, 0x03,   // 0x10=LED1 .. 0x02=LED4
+  0xff, 0x27, 0x10, 0x00, 0x32,   // LED 4
+  0xff, 0x27, 0x10, 0x00, 0x32,   // LED 3
+  0xff, 0x27, 0x10, 0x00, 0x32,   // LED 2
+  0xff, 0x27, 0x10, 0x00, 0x32,   // LED 1
+  0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+int PS3SendRumbleUSB(struct USBOutput *out, int weak, int strong) {
+  pthread_mutex_lock(&out->lock);
+  if (!out->length) {
+    memcpy(out->report, ps3_output_report, sizeof(ps3_output_report));
+    out->length = sizeof(ps3_output_report);
+  }
+  out->report[3] = weak ? 1 : 0;
+  out->report[5] = strong / 256;
+  pthread_mutex_unlock(&out->lock);
+
+  return USBOutputSend(out);
 }
+
+const struct DeviceType PS3Device = {
+  .vendor = USB_VENDOR_ID_SONY,
+  .product = 0x0268,
+  .name = "PS3 controller",
+  .report_size = sizeof(struct Playstation3USBMsg),
+  .endpoint_in = SIXAXIS_ENDPOINT_IN,
+  .endpoint_out = 0,  // Ignores output reports on its interrupt OUT endpoint
+  .control_report_id = 0,
+  .input_mask = ps3_input_mask,
+  .hid_buttons = NULL,          // Descriptor only has vendor defined fields
+  .init = PS3SetOperationalUSB,
+  .decode = PS3DecodeInput,
+  .decode_timestamp = NULL,
+  .decode_motion = NULL,
+  .send_rumble = PS3SendRumbleUSB
+};
@@ -17,5 +17,7 @@
 */
 
 int PS3SetOperationalUSB(libusb_device_handle *usbdev);
-int PS3PollInputUSB(libusb_device_handle *usbdev, struct XpadMsg *msg_out);
-int PS3SendRumbleUSB(libusb_device_handle *usbdev, int weak, int strong);
+void PS3DecodeInput(const unsigned char *report, struct XpadMsg *msg_out);
+int PS3SendRumbleUSB(struct USBOutput *out, int weak, int strong);
+
+extern const struct DeviceType PS3Device;
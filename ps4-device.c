@@ -23,11 +23,18 @@
 #include <string.h>
 #include "usb.h"
 #include "uinput.h"
+#include "orientation.h"
+#include "device-types.h"
+#include "hid-plan.h"
 #include "ps4-device.h"
 
 #define DUALSHOCK4_ENDPOINT_IN  4 | LIBUSB_ENDPOINT_IN
 #define DUALSHOCK4_ENDPOINT_OUT 3 | LIBUSB_ENDPOINT_OUT
 
+// IMU scale: 16.384 LSB per deg/s and 8192 LSB per g
+#define DUALSHOCK4_GYRO_TO_RAD_Q16(x) ((x) * 69813 / 1000)
+#define DUALSHOCK4_ACCL_TO_G_Q14(x)   ((x) * 2)
+
 // http://www.psdevwiki.com/ps4/DS4-USB
 struct Playstation4USBMsg {
 /*00*/  unsigned int unknown00 :8;
@@ -61,8 +68,7 @@ struct Playstation4USBMsg {
 /*08*/ unsigned int abs_l2 :8;
 /*09*/ unsigned int abs_r2 :8;
 
-/*10*/ unsigned int unknown02 :8;
-/*11*/ unsigned int unknown03 :8;
+/*10*/ unsigned int timestamp :16; // Sample counter, 16/3 us per tick
 
 /*12*/ unsigned int battery_level :8;
 
@@ -121,40 +127,38 @@ struct Playstation4USBMsg {
 /*63*/ unsigned int unknown25 :8;
 } __attribute__((__packed__));
 
-
-
-int PS4PollInputUSB(libusb_device_handle *usbdev, struct XpadMsg *msg_out) {
-  struct Playstation4USBMsg ps4msg;
-  int transferred;
-  int ret = libusb_interrupt_transfer(usbdev,
-                                      DUALSHOCK4_ENDPOINT_IN,
-                                      (unsigned char*)&ps4msg, sizeof(ps4msg),
-                                      &transferred, USB_CTRL_GET_TIMEOUT);
-
-  if (ret < 0)
-    return ret;
-
-  msg_out->btn_a = ps4msg.btn_cross;
-  msg_out->btn_b = ps4msg.btn_circle;
-  msg_out->btn_x = ps4msg.btn_square;
-  msg_out->btn_y = ps4msg.btn_triangle;
-  msg_out->btn_start = ps4msg.btn_options;
-  msg_out->btn_select = ps4msg.btn_share;
-  msg_out->btn_guide = ps4msg.btn_playstation;
-  msg_out->btn_ls = ps4msg.btn_l3;
-  msg_out->btn_rs = ps4msg.btn_r3;
-  msg_out->btn_lb = ps4msg.btn_l1;
-  msg_out->btn_rb = ps4msg.btn_r1;
-  msg_out->abs_lt = ps4msg.abs_l2;
-  msg_out->abs_rt = ps4msg.abs_r2;
-  msg_out->abs_lx = ps4msg.abs_lx;
-  msg_out->abs_ly = ps4msg.abs_ly;
-  msg_out->abs_rx = ps4msg.abs_rx;
-  msg_out->abs_ry = ps4msg.abs_ry;
+// Sticks, buttons and analog triggers
+static const unsigned char ps4_input_mask[USB_MAX_REPORT_SIZE] = {
+  [1] = 0xff, [2] = 0xff, [3] = 0xff, [4] = 0xff,
+  [5] = 0xff, [6] = 0xff, [7] = 0x03,
+  [8] = 0xff, [9] = 0xff
+};
+
+
+void PS4DecodeInput(const unsigned char *report, struct XpadMsg *msg_out) {
+  const struct Playstation4USBMsg *ps4msg = (const struct Playstation4USBMsg *)report;
+
+  msg_out->buttons = (ps4msg->btn_cross ? XPAD_BTN_A : 0) |
+                     (ps4msg->btn_circle ? XPAD_BTN_B : 0) |
+                     (ps4msg->btn_square ? XPAD_BTN_X : 0) |
+                     (ps4msg->btn_triangle ? XPAD_BTN_Y : 0) |
+                     (ps4msg->btn_options ? XPAD_BTN_START : 0) |
+                     (ps4msg->btn_share ? XPAD_BTN_SELECT : 0) |
+                     (ps4msg->btn_playstation ? XPAD_BTN_GUIDE : 0) |
+                     (ps4msg->btn_l3 ? XPAD_BTN_LS : 0) |
+                     (ps4msg->btn_r3 ? XPAD_BTN_RS : 0) |
+                     (ps4msg->btn_l1 ? XPAD_BTN_LB : 0) |
+                     (ps4msg->btn_r1 ? XPAD_BTN_RB : 0);
+  msg_out->abs_lt = ps4msg->abs_l2;
+  msg_out->abs_rt = ps4msg->abs_r2;
+  msg_out->abs_lx = ps4msg->abs_lx;
+  msg_out->abs_ly = ps4msg->abs_ly;
+  msg_out->abs_rx = ps4msg->abs_rx;
+  msg_out->abs_ry = ps4msg->abs_ry;
 
   msg_out->abs_dx = 0;
   msg_out->abs_dy = 0;
-  switch(ps4msg.dpad_hat) {
+  switch(ps4msg->dpad_hat) {
   case 0:
     msg_out->abs_dy = -1;
     break;
@@ -183,29 +187,108 @@ int PS4PollInputUSB(libusb_device_handle *usbdev, struct XpadMsg *msg_out) {
     msg_out->abs_dy = -1;
     break;
   }
+}
+
+// Button numbers in the report descriptor
+static const uint32_t ps4_buttons[] = {
+  XPAD_BTN_X,      // Square
+  XPAD_BTN_A,      // Cross
+  XPAD_BTN_B,      // Circle
+  XPAD_BTN_Y,      // Triangle
+  XPAD_BTN_LB,     // L1
+  XPAD_BTN_RB,     // R1
+  0, 0,            // L2, R2 (analog triggers used instead)
+  XPAD_BTN_SELECT, // Share
+  XPAD_BTN_START,  // Options
+  XPAD_BTN_LS,     // L3
+  XPAD_BTN_RS,     // R3
+  XPAD_BTN_GUIDE,  // PS
+  0                // Touchpad click
+};
+
+static const struct HIDButtonMap ps4_button_map = {
+  .count = sizeof(ps4_buttons) / sizeof(ps4_buttons[0]),
+  .buttons = ps4_buttons
+};
+
+uint32_t PS4DecodeTimestamp(const unsigned char *report) {
+  const struct Playstation4USBMsg *ps4msg = (const struct Playstation4USBMsg *)report;
+  return ps4msg->timestamp;
+}
+
+void PS4DecodeMotion(const unsigned char *report, struct MotionMsg *motion_out) {
+  const struct Playstation4USBMsg *ps4msg = (const struct Playstation4USBMsg *)report;
 
-  return 0;
+  motion_out->gyro[0] = DUALSHOCK4_GYRO_TO_RAD_Q16((int16_t)ps4msg->gyro_x);
+  motion_out->gyro[1] = DUALSHOCK4_GYRO_TO_RAD_Q16((int16_t)ps4msg->gyro_y);
+  motion_out->gyro[2] = DUALSHOCK4_GYRO_TO_RAD_Q16((int16_t)ps4msg->gyro_z);
+  motion_out->accl[0] = DUALSHOCK4_ACCL_TO_G_Q14((int16_t)ps4msg->accl_x);
+  motion_out->accl[1] = DUALSHOCK4_ACCL_TO_G_Q14((int16_t)ps4msg->accl_y);
+  motion_out->accl[2] = DUALSHOCK4_ACCL_TO_G_Q14((int16_t)ps4msg->accl_z);
 }
 
-int PS4SendRumbleUSB(libusb_device_handle *usbdev, int weak, int strong) {
-  uint8_t left = strong / 256;
-  uint8_t right = weak / 256;
-
-  uint8_t cmd[] = {
-    0x05,
-    0xFF, 0x00, 0x00, right, left,  // rumble values
-    0xFF, 0xFF, 0xFF, 0x00, 0x00,  // Red, Green, Blue, TimeBright, TimeDark
-    0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00
-  };
-
-  int transferred;
-  int ret = libusb_interrupt_transfer(usbdev,
-                                      DUALSHOCK4_ENDPOINT_OUT,
-                                      (unsigned char*)&cmd, sizeof(cmd),
-                                      &transferred, USB_CTRL_GET_TIMEOUT);
-  printf("Transferred: %d\n", transferred);
+// Output report 0x05. Only the rumble values get patched on each update.
+static const unsigned char ps4_output_report[] = {
+  0x05,
+  0xFF, 0x00, 0x00, 0x00, 0x00,  // rumble values
+  0xFF, 0xFF, 0xFF, 0x00, 0x00,  // Red, Green, Blue, TimeBright, TimeDark
+  0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00
+};
+
+int PS4SendRumbleUSB(struct USBOutput *out, int weak, int strong) {
+  pthread_mutex_lock(&out->lock);
+  if (!out->length) {
+    memcpy(out->report, ps4_output_report, sizeof(ps4_output_report));
+    out->length = sizeof(ps4_output_report);
+  }
+  out->report[4] = weak / 256;
+  out->report[5] = strong / 256;
+  pthread_mutex_unlock(&out->lock);
+
+  return USBOutputSend(out);
 }
+
+const struct DeviceType PS4Device = {
+  .vendor = USB_VENDOR_ID_SONY,
+  .product = 0x05c4,
+  .name = "PS4 controller",
+  .report_size = sizeof(struct Playstation4USBMsg),
+  .endpoint_in = DUALSHOCK4_ENDPOINT_IN,
+  .endpoint_out = DUALSHOCK4_ENDPOINT_OUT,
+  .control_report_id = 1,
+  .timestamp_mask = 0xffff,
+  .timestamp_ns_num = 16000,
+  .timestamp_ns_den = 3,
+  .input_mask = ps4_input_mask,
+  .hid_buttons = &ps4_button_map,
+  .init = NULL,
+  .decode = PS4DecodeInput,
+  .decode_timestamp = PS4DecodeTimestamp,
+  .decode_motion = PS4DecodeMotion,
+  .send_rumble = PS4SendRumbleUSB
+};
+
+// Second revision of the DualShock 4 (CUH-ZCT2). Same protocol over USB.
+const struct DeviceType PS4v2Device = {
+  .vendor = USB_VENDOR_ID_SONY,
+  .product = 0x09cc,
+  .name = "PS4 controller (v2)",
+  .report_size = sizeof(struct Playstation4USBMsg),
+  .endpoint_in = DUALSHOCK4_ENDPOINT_IN,
+  .endpoint_out = DUALSHOCK4_ENDPOINT_OUT,
+  .control_report_id = 1,
+  .timestamp_mask = 0xffff,
+  .timestamp_ns_num = 16000,
+  .timestamp_ns_den = 3,
+  .input_mask = ps4_input_mask,
+  .hid_buttons = &ps4_button_map,
+  .init = NULL,
+  .decode = PS4DecodeInput,
+  .decode_timestamp = PS4DecodeTimestamp,
+  .decode_motion = PS4DecodeMotion,
+  .send_rumble = PS4SendRumbleUSB
+};
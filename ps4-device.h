@@ -16,5 +16,10 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-int PS4PollInputUSB(libusb_device_handle *usbdev, struct XpadMsg *msg_out);
-int PS4SendRumbleUSB(libusb_device_handle *usbdev, int weak, int strong);
+void PS4DecodeInput(const unsigned char *report, struct XpadMsg *msg_out);
+uint32_t PS4DecodeTimestamp(const unsigned char *report);
+void PS4DecodeMotion(const unsigned char *report, struct MotionMsg *motion_out);
+int PS4SendRumbleUSB(struct USBOutput *out, int weak, int strong);
+
+extern const struct DeviceType PS4Device;
+extern const struct DeviceType PS4v2Device;
@@ -0,0 +1,149 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include "usb.h"
+#include "uinput.h"
+#include "device-types.h"
+#include "orientation.h"
+#include "timesync.h"
+#include "latency-probe.h"
+#include "flight-recorder.h"
+#include "metrics.h"
+#include "pad.h"
+#include "recovery.h"
+
+// The watchdog gets armed after this many reports in a row and then expects
+// the next report within a few report intervals.
+#define WATCHDOG_ARM_REPORTS 8
+#define WATCHDOG_INTERVALS 4
+#define WATCHDOG_MIN_MS 20
+
+// Endpoint halt gets cleared this often before the device gets reset
+#define RECOVERY_CLEAR_HALT_TRIES 2
+
+static int64_t TimespecDiffNs(const struct timespec *a, const struct timespec *b) {
+  return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+// Timeout for the next read. Until the report interval is known, this is the
+// usual long timeout (PS3 controllers wait for the PS button to be pressed).
+int RecoveryReadTimeout(struct Pad *pad) {
+  if (pad->recovery_state != RECOVERY_OK || pad->report_streak < WATCHDOG_ARM_REPORTS)
+    return USB_CTRL_GET_TIMEOUT;
+
+  int timeout = pad->report_interval_us * WATCHDOG_INTERVALS / 1000;
+  return timeout < WATCHDOG_MIN_MS ? WATCHDOG_MIN_MS : timeout;
+}
+
+// Checks a successfully read report. Returns 0 if it has to be dropped.
+int RecoveryReportReceived(struct Pad *pad, int transferred, const struct timespec *now) {
+  if (transferred < pad->args.type->report_size) {
+    MetricsAdd(&pad->metrics.short_reports, 1);
+    return 0;
+  }
+
+  // Incident is over with the first complete report
+  if (pad->recovery_state != RECOVERY_OK) {
+    int64_t took = TimespecDiffNs(now, &pad->incident_start);
+    pad->recoveries++;
+    pad->recovery_sum_ns += took;
+    if (took > pad->recovery_max_ns)
+      pad->recovery_max_ns = took;
+    syslog(LOG_INFO, "Controller %03d/%03d: recovered from %s after %lld ms (%d attempts)",
+           pad->args.busnum, pad->args.devnum, USBErrorName(pad->recovery_cause),
+           (long long)(took / 1000000), pad->recovery_attempts);
+    pad->recovery_state = RECOVERY_OK;
+    pad->recovery_attempts = 0;
+    pad->report_streak = 0;
+  }
+
+  // Smoothed interval between reports
+  if (pad->report_streak > 0) {
+    int dt = TimespecDiffNs(now, &pad->last_report_time) / 1000;
+    if (pad->report_interval_us == 0)
+      pad->report_interval_us = dt;
+    else
+      pad->report_interval_us += (dt - pad->report_interval_us) / 8;
+  }
+  pad->last_report_time = *now;
+  pad->report_streak++;
+  return 1;
+}
+
+// Tries to get the device working again after a failed read. Returns 0 if
+// reading should go on or a negative value if the pad has to be given up.
+// The last good state stays on uinput while this is going on.
+int RecoveryHandleError(struct Pad *pad, int error) {
+  const struct DeviceType *type = pad->args.type;
+
+  if (error == LIBUSB_ERROR_TIMEOUT) {
+    MetricsAdd(&pad->metrics.read_timeouts, 1);
+    // Nothing armed the watchdog, so this is just a silent controller
+    if (pad->recovery_state == RECOVERY_WAIT ||
+        (pad->recovery_state == RECOVERY_OK && pad->report_streak < WATCHDOG_ARM_REPORTS))
+      return 0;
+  }
+  else if (error != LIBUSB_ERROR_PIPE && error != LIBUSB_ERROR_OVERFLOW &&
+           error != LIBUSB_ERROR_IO)
+    return error;
+
+  if (pad->recovery_state == RECOVERY_OK) {
+    pad->incidents++;
+    pad->recovery_cause = error;
+    clock_gettime(CLOCK_MONOTONIC, &pad->incident_start);
+    syslog(LOG_WARNING, "Controller %03d/%03d: %s on input endpoint, recovering",
+           pad->args.busnum, pad->args.devnum, USBErrorName(error));
+  }
+  pad->recovery_attempts++;
+  pad->report_streak = 0;
+
+  if (pad->recovery_attempts <= RECOVERY_CLEAR_HALT_TRIES) {
+    pad->recovery_state = RECOVERY_CLEAR_HALT;
+    int ret = USBClearHalt(pad->usbdev, type->endpoint_in);
+    if (ret == LIBUSB_ERROR_NO_DEVICE)
+      return ret;
+    return 0;
+  }
+
+  if (pad->recovery_attempts == RECOVERY_CLEAR_HALT_TRIES + 1) {
+    pad->recovery_state = RECOVERY_RESET;
+    int ret = USBResetDevice(pad->usbdev);
+    if (ret == 0 && type->init)
+      ret = type->init(pad->usbdev);
+    if (ret < 0) {
+      syslog(LOG_ERR, "Controller %03d/%03d: reset failed: %s",
+             pad->args.busnum, pad->args.devnum, USBErrorName(ret));
+      return ret;
+    }
+    return 0;
+  }
+
+  // A controller which just went silent is kept, errors are not
+  if (error == LIBUSB_ERROR_TIMEOUT) {
+    pad->recovery_state = RECOVERY_WAIT;
+    return 0;
+  }
+  syslog(LOG_ERR, "Controller %03d/%03d: recovery failed", pad->args.busnum, pad->args.devnum);
+  return error;
+}
@@ -0,0 +1,29 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// State of the USB error recovery (see recovery.c)
+#define RECOVERY_OK          0  // Reports arrive normally
+#define RECOVERY_CLEAR_HALT  1  // Endpoint halt cleared, waiting for reports
+#define RECOVERY_RESET       2  // Device reset, waiting for reports
+#define RECOVERY_WAIT        3  // Nothing left to try, waiting for reports
+
+struct Pad;
+
+int RecoveryReadTimeout(struct Pad *pad);
+int RecoveryReportReceived(struct Pad *pad, int transferred, const struct timespec *now);
+int RecoveryHandleError(struct Pad *pad, int error);
@@ -0,0 +1,159 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Emulated controllers for the test harnesses. test/fake-libusb.c stands in
+// for libusb below the real usb.c, test/fake-uinput.c replaces the uinput
+// devices (the harnesses are linked with --wrap=UinputInit,
+// --wrap=UinputFrameSend and --wrap=ioctl) and test/fake-udev.c replaces
+// libudev. None of them needs hardware or privileges.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#define FAKE_MAX_DEVICES      64
+#define FAKE_REPORT_RING      4096  // Reports remembered for matching frames
+#define FAKE_LATENCY_BUCKETS  2000  // Latency histogram, 10 us per bucket
+#define FAKE_LATENCY_STEP_US  10
+#define FAKE_OUTPUT_SIZE      64
+#define FAKE_FRAME_EVENTS     64    // Events of one frame at most
+
+struct DeviceType;
+struct libusb_transfer;
+
+struct FakeReport {
+  uint32_t seq;
+  int64_t ns;                   // Time the report was handed to the driver
+};
+
+// One step of a programmed input schedule. "at_us" counts from the moment
+// the driver opens the device. "result" is 0 to deliver a report or the
+// libusb error the read fails with. LIBUSB_ERROR_PIPE stalls the endpoint
+// until the driver clears the halt. A report has "length" bytes (0 = full
+// size) taken from "data", or generated like the periodic ones if "data"
+// is NULL.
+struct FakeStep {
+  int64_t at_us;
+  int result;
+  int length;
+  const unsigned char *data;
+};
+
+// One emulated controller. Generated reports carry the sequence number in
+// the sticks (LX low byte, LY high byte) and toggle the A button, so every
+// report changes and can be found again in the uinput stream with a raw
+// profile. Reports follow the schedule first and then come every
+// "interval_ns" (0 = never).
+//
+// The harness may set the configuration fields between FakeDevicePlug and
+// the driver opening the device.
+struct FakeDevice {
+  int in_use;
+  int busnum;
+  int devnum;
+  const struct DeviceType *type;
+  pthread_mutex_t lock;         // Everything below which isn't atomic
+  pthread_cond_t wake;          // Unplug, new or cancelled transfers
+  int plugged;                  // Atomic, cleared on unplug
+  int open;                     // Open handles
+
+  // Configuration
+  int64_t interval_ns;
+  const struct FakeStep *schedule;
+  int steps;
+  unsigned char endpoint_out;   // Interrupt OUT endpoint in the config descriptor, 0 = none
+  int out_status;               // Completion status of interrupt OUT transfers
+  int64_t out_delay_ns;         // Interrupt OUT transfer time
+  int64_t cancel_delay_ns;      // Time until a cancelled transfer completes
+  int64_t control_delay_ns;     // Control transfer time
+  int clear_halt_result;
+  int reset_result;
+  int timeout_cap_ms;           // Longer read timeouts expire after this, 0 = no cap
+  const unsigned char *descriptor;  // HID report descriptor, NULL = stall the request
+  int descriptor_length;
+
+  // Input side
+  int64_t open_ns;
+  int step;                     // Next step of the schedule
+  int64_t next_ns;              // Next periodic report
+  int halted;                   // IN endpoint stalled
+  uint32_t seq;                 // Atomic, generated reports delivered
+  struct FakeReport reports[FAKE_REPORT_RING];
+
+  // Requests seen by the device
+  int feature_reads;            // GET_REPORT on the control pipe
+  int clear_halts;
+  int resets;
+  int busy_at_close;            // Transfers still in flight when a handle got closed
+
+  // Interrupt OUT transfer in flight
+  struct libusb_transfer *out_transfer;
+  int64_t out_due_ns;           // Completion, also of a cancelled one
+  int out_cancelled;
+
+  // Last output report as the device understands it, starting with the
+  // report ID whichever pipe it came over
+  unsigned char output[FAKE_OUTPUT_SIZE];
+  int output_length;
+  int output_path;              // 0 = interrupt, 1 = control
+  int64_t output_ns;            // Time the device got it
+  uint64_t outputs;
+  uint64_t outputs_bad;         // Control payloads with the report ID in the wrong place
+
+  // Harness end of the uinput stand-in, owned by its reader thread
+  int uinput;                   // -1 = not created yet
+  int fduinput;                 // Driver end
+  int raw;                      // Profile has raw sticks, frames can be matched
+  struct input_event pending[FAKE_FRAME_EVENTS];  // Frame until its SYN_REPORT
+  int pending_count;
+  uint64_t frames;
+  uint64_t frames_lost;         // Sequence gaps
+  uint64_t frames_unmatched;    // Sequence no longer in the ring
+  uint32_t last_seq;
+  uint64_t latency[FAKE_LATENCY_BUCKETS];
+  int64_t latency_max_ns;
+
+  // Force feedback effect handed out on the next upload
+  struct ff_effect effect;
+  int ff_request;
+  int ff_uploads;               // Atomic, completed uploads
+};
+
+struct FakeDevice *FakeDevicePlug(int busnum, int devnum, const struct DeviceType *type,
+                                  int interval_us);
+void FakeDeviceUnplug(struct FakeDevice *dev);
+void FakeDeviceRelease(struct FakeDevice *dev);
+int FakeDeviceOpenHandles(struct FakeDevice *dev);
+uint32_t FakeDeviceReports(struct FakeDevice *dev);
+uint64_t FakeDeviceOutput(struct FakeDevice *dev, unsigned char *output, int *path,
+                          int64_t *ns);
+struct FakeDevice *FakeDeviceCurrent();
+int64_t FakeNowNs();
+
+// Frames are written one event per write() like before they were batched,
+// to compare both. Counted in fake_uinput_writes.
+extern int fake_uinput_event_writes;
+extern uint64_t fake_uinput_writes;
+
+void FakeUinputRelease(struct FakeDevice *dev);
+int FakeUinputLatencyUs(struct FakeDevice *dev, int percentile);
+int FakeUinputUpload(struct FakeDevice *dev, int id, int strong, int weak);
+int64_t FakeUinputPlay(struct FakeDevice *dev, int id, int value);
+
+void FakeUdevEvent(const char *action, struct FakeDevice *dev);
+uint64_t FakeUdevPending();
@@ -0,0 +1,617 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-types.h"
+#include "fake-device.h"
+
+// Stands in for libusb below the real usb.c. Each emulated controller sends
+// input reports as programmed, answers the control requests pspaddrv makes
+// and takes output reports over the control pipe or its interrupt OUT
+// endpoint. Like in libusb, completions of asynchronous transfers are
+// delivered by whichever thread is in a synchronous transfer or handles
+// events.
+
+#define PS3_PRODUCT_ID 0x0268
+
+struct libusb_device {
+  struct FakeDevice *fake;
+};
+
+struct libusb_device_handle {
+  struct FakeDevice *fake;
+  struct libusb_device *device;
+};
+
+// Configuration descriptor with one interface and its endpoints
+struct FakeConfig {
+  struct libusb_config_descriptor config;
+  struct libusb_interface interface;
+  struct libusb_interface_descriptor altsetting;
+  struct libusb_endpoint_descriptor endpoints[2];
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct FakeDevice fake_devices[FAKE_MAX_DEVICES];
+static struct libusb_device fake_usb_devices[FAKE_MAX_DEVICES];
+static __thread struct FakeDevice *fake_current = NULL;
+
+int64_t FakeNowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int FakePlugged(struct FakeDevice *dev) {
+  return __atomic_load_n(&dev->plugged, __ATOMIC_ACQUIRE);
+}
+
+// Adds a controller which udev is about to announce. It has the interrupt
+// OUT endpoint its device type expects and completes every transfer after
+// one frame.
+struct FakeDevice *FakeDevicePlug(int busnum, int devnum, const struct DeviceType *type,
+                                  int interval_us) {
+  struct FakeDevice *dev = NULL;
+  pthread_condattr_t cattr;
+  int i;
+
+  pthread_mutex_lock(&fake_lock);
+  for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+    if (!fake_devices[i].in_use) {
+      dev = &fake_devices[i];
+      memset(dev, 0, sizeof(struct FakeDevice));
+      dev->in_use = 1;
+      dev->busnum = busnum;
+      dev->devnum = devnum;
+      dev->type = type;
+      pthread_mutex_init(&dev->lock, NULL);
+      pthread_condattr_init(&cattr);
+      pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+      pthread_cond_init(&dev->wake, &cattr);
+      pthread_condattr_destroy(&cattr);
+      dev->interval_ns = interval_us * 1000LL;
+      dev->endpoint_out = type->endpoint_out;
+      dev->out_status = LIBUSB_TRANSFER_COMPLETED;
+      dev->out_delay_ns = 1000000;
+      dev->control_delay_ns = 1000000;
+      dev->uinput = -1;
+      dev->fduinput = -1;
+      fake_usb_devices[i].fake = dev;
+      __atomic_store_n(&dev->plugged, 1, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fake_lock);
+  return dev;
+}
+
+// From now on, every transfer fails like on a real unplug
+void FakeDeviceUnplug(struct FakeDevice *dev) {
+  pthread_mutex_lock(&dev->lock);
+  __atomic_store_n(&dev->plugged, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&dev->wake);
+  pthread_mutex_unlock(&dev->lock);
+}
+
+// Frees the slot of an unplugged controller. The driver has to be done with
+// it (no open handles).
+void FakeDeviceRelease(struct FakeDevice *dev) {
+  FakeUinputRelease(dev);
+  pthread_mutex_lock(&fake_lock);
+  pthread_cond_destroy(&dev->wake);
+  pthread_mutex_destroy(&dev->lock);
+  dev->in_use = 0;
+  pthread_mutex_unlock(&fake_lock);
+}
+
+int FakeDeviceOpenHandles(struct FakeDevice *dev) {
+  pthread_mutex_lock(&dev->lock);
+  int open = dev->open;
+  pthread_mutex_unlock(&dev->lock);
+  return open;
+}
+
+uint32_t FakeDeviceReports(struct FakeDevice *dev) {
+  return __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE);
+}
+
+// Copies the last output report. Returns the number of output reports so
+// far.
+uint64_t FakeDeviceOutput(struct FakeDevice *dev, unsigned char *output, int *path,
+                          int64_t *ns) {
+  pthread_mutex_lock(&dev->lock);
+  uint64_t outputs = dev->outputs;
+  if (output)
+    memcpy(output, dev->output, FAKE_OUTPUT_SIZE);
+  if (path)
+    *path = dev->output_path;
+  if (ns)
+    *ns = dev->output_ns;
+  pthread_mutex_unlock(&dev->lock);
+  return outputs;
+}
+
+// Device the calling handler thread opened last
+struct FakeDevice *FakeDeviceCurrent() {
+  return fake_current;
+}
+
+// Writes report "seq" in the layout of the device type
+static void FakeFillReport(struct FakeDevice *dev, unsigned char *report, uint32_t seq,
+                           int64_t now) {
+  memset(report, 0, dev->type->report_size);
+  report[0] = 0x01;
+  if (dev->type->product == PS3_PRODUCT_ID) {
+    report[3] = (seq & 1) << 6;            // Cross
+    report[6] = seq & 0xff;                // LX
+    report[7] = (seq >> 8) & 0xff;         // LY
+    report[8] = 128;
+    report[9] = 128;
+  }
+  else {
+    report[1] = seq & 0xff;                // LX
+    report[2] = (seq >> 8) & 0xff;         // LY
+    report[3] = 128;
+    report[4] = 128;
+    report[5] = 0x08 | (seq & 1) << 5;     // D-pad released, cross
+    uint32_t ticks = now * 3 / 16000;      // 16/3 us per tick
+    report[10] = ticks & 0xff;
+    report[11] = (ticks >> 8) & 0xff;
+  }
+}
+
+// Stores an output report as the device understands it. The DualShock 4
+// expects the report ID as first byte of a SET_REPORT payload, the PS3
+// controller gets the payload without it.
+static void FakeOutput(struct FakeDevice *dev, int path, int id, const unsigned char *data,
+                       int length) {
+  int offset = 0;
+
+  if (path == 1 && dev->type->product == PS3_PRODUCT_ID)
+    offset = 1;
+  else if (path == 1 && (length < 1 || data[0] != id))
+    dev->outputs_bad++;
+  if (length + offset > FAKE_OUTPUT_SIZE)
+    length = FAKE_OUTPUT_SIZE - offset;
+
+  dev->output[0] = id;
+  memcpy(dev->output + offset, data, length);
+  dev->output_length = length + offset;
+  dev->output_path = path;
+  dev->output_ns = FakeNowNs();
+  dev->outputs++;
+}
+
+// Completes the interrupt OUT transfer if it is due, got cancelled or the
+// device is gone. Called with dev->lock held, which is released while the
+// callback runs.
+static void FakeEvents(struct FakeDevice *dev) {
+  while (dev->out_transfer) {
+    struct libusb_transfer *transfer = dev->out_transfer;
+
+    if (!FakePlugged(dev))
+      transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+    else if (FakeNowNs() < dev->out_due_ns)
+      break;
+    else if (dev->out_cancelled)
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    else {
+      transfer->status = dev->out_status;
+      if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        FakeOutput(dev, 0, transfer->buffer[0], transfer->buffer, transfer->length);
+        transfer->actual_length = transfer->length;
+      }
+    }
+
+    dev->out_transfer = NULL;
+    pthread_mutex_unlock(&dev->lock);
+    transfer->callback(transfer);
+    pthread_mutex_lock(&dev->lock);
+  }
+}
+
+// Waits until "until" or a wakeup, whatever comes first. Transfers which
+// complete in between get completed. Called with dev->lock held.
+static void FakeWait(struct FakeDevice *dev, int64_t until) {
+  if (dev->out_transfer && dev->out_due_ns < until)
+    until = dev->out_due_ns;
+  if (until > FakeNowNs()) {
+    struct timespec ts = {until / 1000000000LL, until % 1000000000LL};
+    pthread_cond_timedwait(&dev->wake, &dev->lock, &ts);
+  }
+  FakeEvents(dev);
+}
+
+// Time the next report or error is due
+static int64_t FakeNextDue(struct FakeDevice *dev) {
+  if (dev->step < dev->steps)
+    return dev->open_ns + dev->schedule[dev->step].at_us * 1000;
+  if (dev->interval_ns)
+    return dev->next_ns;
+  return INT64_MAX;
+}
+
+// Generates the next report with a sequence number. Short ones don't count
+// as reports and keep the number.
+static void FakeGenerate(struct FakeDevice *dev, unsigned char *data, int length,
+                         int64_t now) {
+  unsigned char report[USB_MAX_REPORT_SIZE];
+  uint32_t seq = dev->seq;
+
+  FakeFillReport(dev, report, seq, now);
+  memcpy(data, report, length);
+  if (length < dev->type->report_size)
+    return;
+
+  struct FakeReport *entry = &dev->reports[seq % FAKE_REPORT_RING];
+  entry->seq = seq;
+  entry->ns = FakeNowNs();
+  __atomic_store_n(&dev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Hands out whatever is due now on the IN endpoint
+static int FakeDeliver(struct FakeDevice *dev, unsigned char *data, int length,
+                       int *transferred, int64_t now) {
+  if (dev->step < dev->steps) {
+    const struct FakeStep *step = &dev->schedule[dev->step++];
+    dev->next_ns = dev->open_ns + step->at_us * 1000 + dev->interval_ns;
+    if (step->result < 0) {
+      if (step->result == LIBUSB_ERROR_PIPE)
+        dev->halted = 1;
+      return step->result;
+    }
+
+    int size = step->length ? step->length : dev->type->report_size;
+    if (size > length)
+      size = length;
+    if (step->data)
+      memcpy(data, step->data, size);
+    else
+      FakeGenerate(dev, data, size, now);
+    *transferred = size;
+    return 0;
+  }
+
+  // Like an interrupt endpoint, a slow reader misses reports instead of
+  // getting them queued up
+  dev->next_ns += dev->interval_ns;
+  if (dev->next_ns < now)
+    dev->next_ns = now + dev->interval_ns;
+  FakeGenerate(dev, data, dev->type->report_size, now);
+  *transferred = dev->type->report_size;
+  return 0;
+}
+
+static int FakeReadReport(struct FakeDevice *dev, unsigned char *data, int length,
+                          int *transferred, unsigned int timeout) {
+  if (dev->timeout_cap_ms && (timeout == 0 || timeout > (unsigned int)dev->timeout_cap_ms))
+    timeout = dev->timeout_cap_ms;
+  int64_t deadline = timeout ? FakeNowNs() + timeout * 1000000LL : INT64_MAX;
+  int ret;
+
+  *transferred = 0;
+  pthread_mutex_lock(&dev->lock);
+  FakeEvents(dev);
+  while (1) {
+    if (!FakePlugged(dev)) {
+      ret = LIBUSB_ERROR_NO_DEVICE;
+      break;
+    }
+    if (dev->halted) {
+      ret = LIBUSB_ERROR_PIPE;
+      break;
+    }
+
+    int64_t now = FakeNowNs();
+    int64_t due = FakeNextDue(dev);
+    if (now >= due) {
+      ret = FakeDeliver(dev, data, length, transferred, now);
+      break;
+    }
+    if (now >= deadline) {
+      ret = LIBUSB_ERROR_TIMEOUT;
+      break;
+    }
+    FakeWait(dev, due < deadline ? due : deadline);
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return ret;
+}
+
+int libusb_init(libusb_context **ctx) {
+  return 0;
+}
+
+void libusb_exit(libusb_context *ctx) {
+}
+
+const char *libusb_error_name(int code) {
+  switch (code) {
+  case LIBUSB_SUCCESS:             return "LIBUSB_SUCCESS";
+  case LIBUSB_ERROR_IO:            return "LIBUSB_ERROR_IO";
+  case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+  case LIBUSB_ERROR_NO_DEVICE:     return "LIBUSB_ERROR_NO_DEVICE";
+  case LIBUSB_ERROR_NOT_FOUND:     return "LIBUSB_ERROR_NOT_FOUND";
+  case LIBUSB_ERROR_BUSY:          return "LIBUSB_ERROR_BUSY";
+  case LIBUSB_ERROR_TIMEOUT:       return "LIBUSB_ERROR_TIMEOUT";
+  case LIBUSB_ERROR_OVERFLOW:      return "LIBUSB_ERROR_OVERFLOW";
+  case LIBUSB_ERROR_PIPE:          return "LIBUSB_ERROR_PIPE";
+  case LIBUSB_ERROR_NO_MEM:        return "LIBUSB_ERROR_NO_MEM";
+  default:                         return "LIBUSB_ERROR_OTHER";
+  }
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+  ssize_t count = 0;
+  int i;
+
+  *list = calloc(FAKE_MAX_DEVICES + 1, sizeof(libusb_device *));
+  if (*list == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+
+  pthread_mutex_lock(&fake_lock);
+  for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+    if (fake_devices[i].in_use && FakePlugged(&fake_devices[i]))
+      (*list)[count++] = &fake_usb_devices[i];
+  }
+  pthread_mutex_unlock(&fake_lock);
+  return count;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref) {
+  free(list);
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev) {
+  return dev->fake->busnum;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev) {
+  return dev->fake->devnum;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle) {
+  struct FakeDevice *fake = dev->fake;
+
+  if (!FakePlugged(fake))
+    return LIBUSB_ERROR_NO_DEVICE;
+  *handle = malloc(sizeof(struct libusb_device_handle));
+  if (*handle == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  (*handle)->fake = fake;
+  (*handle)->device = dev;
+
+  pthread_mutex_lock(&fake->lock);
+  fake->open++;
+  fake->open_ns = FakeNowNs();
+  fake->next_ns = fake->open_ns;
+  fake->step = 0;
+  pthread_mutex_unlock(&fake->lock);
+  fake_current = fake;
+  return 0;
+}
+
+void libusb_close(libusb_device_handle *handle) {
+  struct FakeDevice *fake = handle->fake;
+
+  // The driver must not close with a transfer in flight. It is dropped
+  // without callback, the harness checks busy_at_close.
+  pthread_mutex_lock(&fake->lock);
+  if (fake->out_transfer) {
+    fake->busy_at_close++;
+    fake->out_transfer = NULL;
+  }
+  fake->open--;
+  pthread_mutex_unlock(&fake->lock);
+  free(handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *handle) {
+  return handle->device;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int interface) {
+  return FakePlugged(handle->fake) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface) {
+  return FakePlugged(handle->fake) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_clear_halt(libusb_device_handle *handle, unsigned char endpoint) {
+  struct FakeDevice *fake = handle->fake;
+  int ret = LIBUSB_ERROR_NO_DEVICE;
+
+  pthread_mutex_lock(&fake->lock);
+  fake->clear_halts++;
+  if (FakePlugged(fake)) {
+    ret = fake->clear_halt_result;
+    if (ret == 0)
+      fake->halted = 0;
+  }
+  pthread_mutex_unlock(&fake->lock);
+  return ret;
+}
+
+int libusb_reset_device(libusb_device_handle *handle) {
+  struct FakeDevice *fake = handle->fake;
+  int ret = LIBUSB_ERROR_NO_DEVICE;
+
+  pthread_mutex_lock(&fake->lock);
+  fake->resets++;
+  if (FakePlugged(fake)) {
+    ret = fake->reset_result;
+    if (ret == 0)
+      fake->halted = 0;
+  }
+  pthread_mutex_unlock(&fake->lock);
+  return ret;
+}
+
+// Answers the report descriptor, GET_REPORT and SET_REPORT requests
+int libusb_control_transfer(libusb_device_handle *handle, uint8_t request_type,
+                            uint8_t request, uint16_t value, uint16_t index,
+                            unsigned char *data, uint16_t length, unsigned int timeout) {
+  struct FakeDevice *fake = handle->fake;
+  int ret = LIBUSB_ERROR_PIPE;
+
+  pthread_mutex_lock(&fake->lock);
+  int64_t done = FakeNowNs() + fake->control_delay_ns;
+  while (FakePlugged(fake) && FakeNowNs() < done)
+    FakeWait(fake, done);
+
+  if (!FakePlugged(fake))
+    ret = LIBUSB_ERROR_NO_DEVICE;
+  else if (request_type == (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+                            LIBUSB_RECIPIENT_INTERFACE) &&
+           request == LIBUSB_REQUEST_GET_DESCRIPTOR && (value >> 8) == HID_DT_REPORT) {
+    if (fake->descriptor) {
+      ret = fake->descriptor_length < length ? fake->descriptor_length : length;
+      memcpy(data, fake->descriptor, ret);
+    }
+  }
+  else if (request_type == (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+                            LIBUSB_RECIPIENT_INTERFACE) && request == HID_REQ_GET_REPORT) {
+    fake->feature_reads++;
+    memset(data, 0, length);
+    ret = length;
+  }
+  else if (request_type == (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
+                            LIBUSB_RECIPIENT_INTERFACE) && request == HID_REQ_SET_REPORT &&
+           (value >> 8) == HID_OUTPUT_REPORT) {
+    FakeOutput(fake, 1, value & 0xff, data, length);
+    ret = length;
+  }
+  pthread_mutex_unlock(&fake->lock);
+  return ret;
+}
+
+int libusb_interrupt_transfer(libusb_device_handle *handle, unsigned char endpoint,
+                              unsigned char *data, int length, int *transferred,
+                              unsigned int timeout) {
+  if (endpoint & LIBUSB_ENDPOINT_IN)
+    return FakeReadReport(handle->fake, data, length, transferred, timeout);
+  return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev,
+                                        struct libusb_config_descriptor **config) {
+  struct FakeDevice *fake = dev->fake;
+  struct FakeConfig *fc = calloc(1, sizeof(struct FakeConfig));
+
+  if (fc == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  fc->config.bNumInterfaces = 1;
+  fc->config.interface = &fc->interface;
+  fc->interface.altsetting = &fc->altsetting;
+  fc->interface.num_altsetting = 1;
+  fc->altsetting.endpoint = fc->endpoints;
+  fc->endpoints[0].bEndpointAddress = fake->type->endpoint_in;
+  fc->endpoints[0].bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+  fc->altsetting.bNumEndpoints = 1;
+  if (fake->endpoint_out) {
+    fc->endpoints[1].bEndpointAddress = fake->endpoint_out;
+    fc->endpoints[1].bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+    fc->altsetting.bNumEndpoints = 2;
+  }
+  *config = &fc->config;
+  return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config) {
+  free(config);
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+  return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+  free(transfer);
+}
+
+// Only interrupt OUT transfers are done asynchronously, one at a time
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+  struct FakeDevice *fake = transfer->dev_handle->fake;
+  int ret = 0;
+
+  pthread_mutex_lock(&fake->lock);
+  if (!FakePlugged(fake))
+    ret = LIBUSB_ERROR_NO_DEVICE;
+  else if (transfer->endpoint != fake->endpoint_out)
+    ret = LIBUSB_ERROR_NOT_FOUND;
+  else if (fake->out_transfer)
+    ret = LIBUSB_ERROR_BUSY;
+  else {
+    fake->out_transfer = transfer;
+    fake->out_due_ns = FakeNowNs() + fake->out_delay_ns;
+    fake->out_cancelled = 0;
+    pthread_cond_broadcast(&fake->wake);
+  }
+  pthread_mutex_unlock(&fake->lock);
+  return ret;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+  struct FakeDevice *fake = transfer->dev_handle->fake;
+  int ret = LIBUSB_ERROR_NOT_FOUND;
+
+  pthread_mutex_lock(&fake->lock);
+  if (fake->out_transfer == transfer && !fake->out_cancelled) {
+    int64_t due = FakeNowNs() + fake->cancel_delay_ns;
+    if (due < fake->out_due_ns)
+      fake->out_due_ns = due;
+    fake->out_cancelled = 1;
+    pthread_cond_broadcast(&fake->wake);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&fake->lock);
+  return ret;
+}
+
+// Completes what is due on any device, waiting up to "tv" for something
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv) {
+  int64_t until = FakeNowNs() + tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+  int i;
+
+  do {
+    int pending = 0;
+    for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+      struct FakeDevice *fake = &fake_devices[i];
+      pthread_mutex_lock(&fake_lock);
+      int in_use = fake->in_use;
+      pthread_mutex_unlock(&fake_lock);
+      if (!in_use)
+        continue;
+      pthread_mutex_lock(&fake->lock);
+      FakeEvents(fake);
+      pending += fake->out_transfer != NULL;
+      pthread_mutex_unlock(&fake->lock);
+    }
+    if (!pending)
+      return 0;
+
+    struct timespec ts = {0, 100000};
+    nanosleep(&ts, NULL);
+  } while (FakeNowNs() < until);
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <libudev.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-types.h"
+#include "fake-device.h"
+
+// Replaces libudev for the soak harness. The monitor delivers hotplug
+// events the harness queues with FakeUdevEvent, enumeration finds nothing.
+
+struct udev {
+  int unused;
+};
+
+struct udev_monitor {
+  int unused;
+};
+
+struct udev_enumerate {
+  int unused;
+};
+
+struct udev_device {
+  struct udev_device *next;
+  char action[8];
+  char vendor[8];
+  char product[8];
+  char busnum[8];
+  char devnum[8];
+};
+
+static pthread_once_t udev_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t udev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct udev_device *udev_queue = NULL;
+static struct udev_device **udev_queue_tail = &udev_queue;
+static uint64_t udev_queued = 0;
+static uint64_t udev_handled = 0;  // Devices released by the driver
+static int udev_pipe[2] = {-1, -1};
+
+static struct udev fake_udev;
+static struct udev_monitor fake_monitor;
+static struct udev_enumerate fake_enumerate;
+
+static void FakeUdevSetup() {
+  if (pipe2(udev_pipe, O_CLOEXEC) < 0) {
+    fprintf(stderr, "Can't create udev event pipe\n");
+    _exit(2);
+  }
+}
+
+// Announces "action" ("add" or "remove") for an emulated controller
+void FakeUdevEvent(const char *action, struct FakeDevice *dev) {
+  struct udev_device *event = calloc(1, sizeof(struct udev_device));
+
+  pthread_once(&udev_once, FakeUdevSetup);
+  if (event == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    _exit(2);
+  }
+  snprintf(event->action, sizeof(event->action), "%s", action);
+  snprintf(event->vendor, sizeof(event->vendor), "%04x", dev->type->vendor);
+  snprintf(event->product, sizeof(event->product), "%04x", dev->type->product);
+  snprintf(event->busnum, sizeof(event->busnum), "%03d", dev->busnum);
+  snprintf(event->devnum, sizeof(event->devnum), "%03d", dev->devnum);
+
+  pthread_mutex_lock(&udev_lock);
+  *udev_queue_tail = event;
+  udev_queue_tail = &event->next;
+  udev_queued++;
+  pthread_mutex_unlock(&udev_lock);
+
+  char byte = 0;
+  if (write(udev_pipe[1], &byte, 1) != 1) {
+    fprintf(stderr, "Can't queue udev event\n");
+    _exit(2);
+  }
+}
+
+// Number of events the driver did not finish handling yet
+uint64_t FakeUdevPending() {
+  pthread_mutex_lock(&udev_lock);
+  uint64_t pending = udev_queued - udev_handled;
+  pthread_mutex_unlock(&udev_lock);
+  return pending;
+}
+
+struct udev *udev_new(void) {
+  pthread_once(&udev_once, FakeUdevSetup);
+  return &fake_udev;
+}
+
+struct udev *udev_unref(struct udev *udev) {
+  return NULL;
+}
+
+struct udev_monitor *udev_monitor_new_from_netlink(struct udev *udev, const char *name) {
+  return &fake_monitor;
+}
+
+int udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *udev_monitor,
+                                                    const char *subsystem, const char *devtype) {
+  return 0;
+}
+
+int udev_monitor_enable_receiving(struct udev_monitor *udev_monitor) {
+  return 0;
+}
+
+int udev_monitor_get_fd(struct udev_monitor *udev_monitor) {
+  return udev_pipe[0];
+}
+
+struct udev_monitor *udev_monitor_unref(struct udev_monitor *udev_monitor) {
+  return NULL;
+}
+
+struct udev_device *udev_monitor_receive_device(struct udev_monitor *udev_monitor) {
+  struct udev_device *event;
+  char byte;
+
+  if (read(udev_pipe[0], &byte, 1) != 1)
+    return NULL;
+
+  pthread_mutex_lock(&udev_lock);
+  event = udev_queue;
+  if (event) {
+    udev_queue = event->next;
+    if (udev_queue == NULL)
+      udev_queue_tail = &udev_queue;
+  }
+  pthread_mutex_unlock(&udev_lock);
+  return event;
+}
+
+struct udev_device *udev_device_unref(struct udev_device *udev_device) {
+  if (udev_device) {
+    free(udev_device);
+    pthread_mutex_lock(&udev_lock);
+    udev_handled++;
+    pthread_mutex_unlock(&udev_lock);
+  }
+  return NULL;
+}
+
+const char *udev_device_get_property_value(struct udev_device *udev_device, const char *key) {
+  if (strcmp(key, "ACTION") == 0)
+    return udev_device->action;
+  if (strcmp(key, "ID_VENDOR_ID") == 0)
+    return udev_device->vendor;
+  if (strcmp(key, "ID_MODEL_ID") == 0)
+    return udev_device->product;
+  if (strcmp(key, "BUSNUM") == 0)
+    return udev_device->busnum;
+  if (strcmp(key, "DEVNUM") == 0)
+    return udev_device->devnum;
+  return NULL;
+}
+
+struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath) {
+  return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev) {
+  return &fake_enumerate;
+}
+
+int udev_enumerate_add_match_subsystem(struct udev_enumerate *udev_enumerate,
+                                       const char *subsystem) {
+  return 0;
+}
+
+int udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate,
+                                      const char *property, const char *value) {
+  return 0;
+}
+
+int udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate) {
+  return 0;
+}
+
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *udev_enumerate) {
+  return NULL;
+}
+
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *list_entry) {
+  return NULL;
+}
+
+const char *udev_list_entry_get_name(struct udev_list_entry *list_entry) {
+  return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *udev_enumerate) {
+  return NULL;
+}
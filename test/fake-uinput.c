@@ -0,0 +1,335 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/uinput.h>
+#include "../uinput.h"
+#include "fake-device.h"
+
+// Stand-in for the uinput devices of the controllers. The harnesses are
+// linked with --wrap=UinputInit, so each handler writes its frames into one
+// end of a socket pair. A reader thread drains the other ends like the
+// kernel would and matches each frame with the report it came from. Force
+// feedback requests go the other way, the ioctls which belong to them are
+// answered through --wrap=ioctl. Frames are sent through
+// --wrap=UinputFrameSend, which can also write them event by event.
+
+#define FAKE_FF_TIMEOUT_MS 1000
+
+static pthread_once_t uinput_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t uinput_lock = PTHREAD_MUTEX_INITIALIZER;
+static int uinput_epoll = -1;
+static struct FakeDevice *uinput_devices[FAKE_MAX_DEVICES];
+
+int fake_uinput_event_writes;
+uint64_t fake_uinput_writes;
+
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_UinputFrameSend(int fd, struct UinputFrame *frame);
+
+// Accounts one frame written by the driver
+static void FakeUinputFrame(struct FakeDevice *dev, const struct input_event *events, int count,
+                            int64_t now) {
+  int have_x = 0, have_y = 0;
+  int x = 0, y = 0;
+  int i;
+
+  dev->frames++;
+  if (!dev->raw)
+    return;
+
+  for (i = 0; i < count; i++) {
+    if (events[i].type == EV_ABS && events[i].code == ABS_X) {
+      x = events[i].value;
+      have_x = 1;
+    }
+    else if (events[i].type == EV_ABS && events[i].code == ABS_Y) {
+      y = events[i].value;
+      have_y = 1;
+    }
+  }
+  if (!have_x || !have_y) {
+    dev->frames_unmatched++;
+    return;
+  }
+
+  // Sticks carry the low 16 bits of the sequence number
+  uint32_t seq = (y << 8) | x;
+  if (dev->frames > 1)
+    dev->frames_lost += (uint16_t)(seq - dev->last_seq - 1);
+  dev->last_seq = seq;
+
+  const struct FakeReport *report = &dev->reports[seq % FAKE_REPORT_RING];
+  uint32_t reported = __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE);
+  if ((report->seq & 0xffff) != seq || reported - report->seq > FAKE_REPORT_RING) {
+    dev->frames_unmatched++;
+    return;
+  }
+
+  int64_t latency = now - report->ns;
+  int bucket = latency / (FAKE_LATENCY_STEP_US * 1000);
+  if (bucket >= FAKE_LATENCY_BUCKETS)
+    bucket = FAKE_LATENCY_BUCKETS - 1;
+  dev->latency[bucket]++;
+  if (latency > dev->latency_max_ns)
+    dev->latency_max_ns = latency;
+}
+
+// Collects the events of a stand-in up to SYN_REPORT
+static void FakeUinputEvents(struct FakeDevice *dev, const struct input_event *events, int count,
+                             int64_t now) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (dev->pending_count < FAKE_FRAME_EVENTS)
+      dev->pending[dev->pending_count++] = events[i];
+    if (events[i].type == EV_SYN && events[i].code == SYN_REPORT) {
+      FakeUinputFrame(dev, dev->pending, dev->pending_count, now);
+      dev->pending_count = 0;
+    }
+  }
+}
+
+static void *FakeUinputThread(void *arg) {
+  struct epoll_event events[FAKE_MAX_DEVICES];
+  struct input_event frame[FAKE_FRAME_EVENTS];
+  int i;
+
+  while (1) {
+    int n = epoll_wait(uinput_epoll, events, FAKE_MAX_DEVICES, -1);
+    for (i = 0; i < n; i++) {
+      struct FakeDevice *dev = events[i].data.ptr;
+
+      // The device may have been released since epoll_wait returned
+      pthread_mutex_lock(&uinput_lock);
+      if (dev->uinput >= 0) {
+        ssize_t size;
+        while ((size = recv(dev->uinput, frame, sizeof(frame), MSG_DONTWAIT)) > 0)
+          FakeUinputEvents(dev, frame, size / sizeof(struct input_event), FakeNowNs());
+        // Driver closed its end
+        if (size == 0)
+          epoll_ctl(uinput_epoll, EPOLL_CTL_DEL, dev->uinput, NULL);
+      }
+      pthread_mutex_unlock(&uinput_lock);
+    }
+  }
+
+  return NULL;
+}
+
+static void FakeUinputSetup() {
+  pthread_t tid;
+  pthread_attr_t tattr;
+
+  uinput_epoll = epoll_create1(EPOLL_CLOEXEC);
+  pthread_attr_init(&tattr);
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  if (uinput_epoll < 0 || pthread_create(&tid, &tattr, FakeUinputThread, NULL) != 0) {
+    fprintf(stderr, "Can't start uinput reader\n");
+    _exit(2);
+  }
+  pthread_attr_destroy(&tattr);
+}
+
+// Called instead of UinputInit. The driver gets its end of a new socket
+// pair as uinput file descriptor.
+int __wrap_UinputInit(const struct UinputProfile *profile) {
+  struct FakeDevice *dev = FakeDeviceCurrent();
+  int sv[2];
+
+  pthread_once(&uinput_once, FakeUinputSetup);
+  if (dev == NULL || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+
+  pthread_mutex_lock(&uinput_lock);
+  dev->uinput = sv[1];
+  dev->fduinput = sv[0];
+  dev->raw = profile->raw_sticks;
+  struct epoll_event event = {EPOLLIN, {.ptr = dev}};
+  epoll_ctl(uinput_epoll, EPOLL_CTL_ADD, sv[1], &event);
+  // A driver end closed earlier may have had the same number
+  int i, slot = -1;
+  for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+    if (uinput_devices[i] && uinput_devices[i]->fduinput == sv[0])
+      uinput_devices[i]->fduinput = -1;
+    if (!uinput_devices[i] && slot < 0)
+      slot = i;
+  }
+  if (slot >= 0)
+    uinput_devices[slot] = dev;
+  pthread_mutex_unlock(&uinput_lock);
+  return sv[0];
+}
+
+// Called instead of UinputFrameSend
+int __wrap_UinputFrameSend(int fd, struct UinputFrame *frame) {
+  int i;
+
+  if (!__atomic_load_n(&fake_uinput_event_writes, __ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&fake_uinput_writes, 1, __ATOMIC_RELAXED);
+    return __real_UinputFrameSend(fd, frame);
+  }
+
+  struct input_event *syn = &frame->events[frame->count++];
+  syn->type = EV_SYN;
+  syn->code = SYN_REPORT;
+  syn->value = 0;
+  for (i = 0; i < frame->count; i++) {
+    __atomic_add_fetch(&fake_uinput_writes, 1, __ATOMIC_RELAXED);
+    if (write(fd, &frame->events[i], sizeof(struct input_event)) < 0) {
+      frame->count = 0;
+      return -1;
+    }
+  }
+  frame->count = 0;
+  return 0;
+}
+
+// Answers the force feedback ioctls on the driver end of a stand-in. The
+// effect to upload is the one FakeUinputUpload put there.
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+  struct FakeDevice *dev = NULL;
+  va_list args;
+  int i;
+
+  va_start(args, request);
+  void *arg = va_arg(args, void *);
+  va_end(args);
+
+  pthread_mutex_lock(&uinput_lock);
+  for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+    if (uinput_devices[i] && uinput_devices[i]->fduinput == fd)
+      dev = uinput_devices[i];
+  }
+  if (dev == NULL) {
+    pthread_mutex_unlock(&uinput_lock);
+    return __real_ioctl(fd, request, arg);
+  }
+
+  int ret = 0;
+  if (request == UI_BEGIN_FF_UPLOAD) {
+    struct uinput_ff_upload *upload = arg;
+    if (upload->request_id == (uint32_t)dev->ff_request) {
+      upload->effect = dev->effect;
+      upload->retval = 0;
+    }
+    else {
+      errno = EINVAL;
+      ret = -1;
+    }
+  }
+  else if (request == UI_END_FF_UPLOAD)
+    __atomic_add_fetch(&dev->ff_uploads, 1, __ATOMIC_RELEASE);
+  else if (request != UI_BEGIN_FF_ERASE && request != UI_END_FF_ERASE) {
+    errno = ENOTTY;
+    ret = -1;
+  }
+  pthread_mutex_unlock(&uinput_lock);
+  return ret;
+}
+
+// Sends one event to the driver like the kernel would
+static int FakeUinputEvent(struct FakeDevice *dev, int type, int code, int value) {
+  struct input_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.code = code;
+  event.value = value;
+  return send(dev->uinput, &event, sizeof(event), 0) == sizeof(event) ? 0 : -1;
+}
+
+// Uploads a rumble effect like a game would. Returns once the driver has
+// finished the upload.
+int FakeUinputUpload(struct FakeDevice *dev, int id, int strong, int weak) {
+  int i;
+
+  pthread_mutex_lock(&uinput_lock);
+  memset(&dev->effect, 0, sizeof(dev->effect));
+  dev->effect.type = FF_RUMBLE;
+  dev->effect.id = id;
+  dev->effect.u.rumble.strong_magnitude = strong;
+  dev->effect.u.rumble.weak_magnitude = weak;
+  int request = ++dev->ff_request;
+  int uploads = __atomic_load_n(&dev->ff_uploads, __ATOMIC_ACQUIRE);
+  int ret = dev->uinput >= 0 ? FakeUinputEvent(dev, EV_UINPUT, UI_FF_UPLOAD, request) : -1;
+  pthread_mutex_unlock(&uinput_lock);
+  if (ret < 0)
+    return -1;
+
+  for (i = 0; i < FAKE_FF_TIMEOUT_MS * 10; i++) {
+    if (__atomic_load_n(&dev->ff_uploads, __ATOMIC_ACQUIRE) != uploads)
+      return 0;
+    usleep(100);
+  }
+  return -1;
+}
+
+// Starts (value 1) or stops (value 0) an uploaded effect. Returns the time
+// the event was sent or -1.
+int64_t FakeUinputPlay(struct FakeDevice *dev, int id, int value) {
+  pthread_mutex_lock(&uinput_lock);
+  int64_t now = FakeNowNs();
+  int ret = dev->uinput >= 0 ? FakeUinputEvent(dev, EV_FF, id, value) : -1;
+  pthread_mutex_unlock(&uinput_lock);
+  return ret < 0 ? -1 : now;
+}
+
+// Closes the harness end of the stand-in of "dev"
+void FakeUinputRelease(struct FakeDevice *dev) {
+  int i;
+
+  pthread_mutex_lock(&uinput_lock);
+  if (dev->uinput >= 0) {
+    epoll_ctl(uinput_epoll, EPOLL_CTL_DEL, dev->uinput, NULL);
+    close(dev->uinput);
+    dev->uinput = -1;
+  }
+  dev->fduinput = -1;
+  for (i = 0; i < FAKE_MAX_DEVICES; i++) {
+    if (uinput_devices[i] == dev)
+      uinput_devices[i] = NULL;
+  }
+  pthread_mutex_unlock(&uinput_lock);
+}
+
+// Latency from report to frame below which "percentile" percent of all
+// matched frames are
+int FakeUinputLatencyUs(struct FakeDevice *dev, int percentile) {
+  uint64_t total = 0, count = 0;
+  int i;
+
+  pthread_mutex_lock(&uinput_lock);
+  for (i = 0; i < FAKE_LATENCY_BUCKETS; i++)
+    total += dev->latency[i];
+  for (i = 0; i < FAKE_LATENCY_BUCKETS && total; i++) {
+    count += dev->latency[i];
+    if (count * 100 >= total * percentile)
+      break;
+  }
+  pthread_mutex_unlock(&uinput_lock);
+  return (i + 1) * FAKE_LATENCY_STEP_US;
+}
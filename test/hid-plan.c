@@ -0,0 +1,125 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-types.h"
+#include "../hid-plan.h"
+#include "../ps4-device.h"
+
+// Compiles the decode plan from the DS4 report descriptor and checks that it
+// decodes random reports exactly like the hand written PS4DecodeInput. Then
+// mutates the descriptor at random and checks that the compiler either
+// refuses it or stays within the report buffer.
+
+#define RANDOM_REPORTS 4096
+#define MUTATIONS      20000
+
+static const unsigned char ds4_descriptor[] = {
+  0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x85, 0x01, 0x09, 0x30, 0x09, 0x31,
+  0x09, 0x32, 0x09, 0x35, 0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95,
+  0x04, 0x81, 0x02, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x35, 0x00, 0x46,
+  0x3b, 0x01, 0x65, 0x14, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42, 0x65, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x0e, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01,
+  0x95, 0x0e, 0x81, 0x02, 0x06, 0x00, 0xff, 0x09, 0x20, 0x75, 0x06, 0x95,
+  0x01, 0x15, 0x00, 0x25, 0x7f, 0x81, 0x02, 0x05, 0x01, 0x09, 0x33, 0x09,
+  0x34, 0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, 0x02, 0x81, 0x02,
+  0x06, 0x00, 0xff, 0x09, 0x21, 0x95, 0x36, 0x81, 0x02, 0x85, 0x05, 0x09,
+  0x22, 0x95, 0x1f, 0x91, 0x02, 0xc0
+};
+
+// Ops read 4 bytes starting at their offset
+static int PlanInBounds(const struct HIDPlan *plan) {
+  int i;
+
+  if (plan->count > HID_PLAN_MAX_OPS)
+    return 0;
+  for (i = 0; i < plan->count; i++) {
+    const struct HIDPlanOp *op = &plan->ops[i];
+    if (op->offset + 4 > USB_MAX_REPORT_SIZE || op->shift >= 8 || op->width > 24)
+      return 0;
+  }
+  return 1;
+}
+
+int main() {
+  static unsigned char reports[RANDOM_REPORTS][USB_MAX_REPORT_SIZE];
+  unsigned char desc[sizeof(ds4_descriptor)];
+  struct HIDPlan plan;
+  int failed = 0;
+  int mismatches = 0;
+  int refused = 0;
+  int i, j;
+
+  if (HIDPlanCompile(&plan, ds4_descriptor, sizeof(ds4_descriptor), PS4Device.hid_buttons) < 0) {
+    fprintf(stderr, "DS4 descriptor did not compile\n");
+    return 1;
+  }
+  printf("DS4 plan: report ID %d, %d ops\n", plan.report_id, plan.count);
+
+  srand(1);
+  for (i = 0; i < RANDOM_REPORTS; i++) {
+    for (j = 0; j < USB_MAX_REPORT_SIZE; j++)
+      reports[i][j] = rand();
+    reports[i][0] = plan.report_id;
+  }
+
+  for (i = 0; i < RANDOM_REPORTS; i++) {
+    struct XpadMsg expected, decoded;
+    memset(&expected, 0, sizeof(expected));
+    PS4DecodeInput(reports[i], &expected);
+    HIDPlanDecode(&plan, reports[i], &decoded);
+    if (memcmp(&expected, &decoded, sizeof(expected)) != 0) {
+      if (mismatches++ < 5) {
+        fprintf(stderr, "Report %d decodes differently:", i);
+        for (j = 0; j < 12; j++)
+          fprintf(stderr, " %02x", reports[i][j]);
+        fprintf(stderr, "\n");
+      }
+    }
+  }
+  printf("%d random reports, %d decoded differently\n", RANDOM_REPORTS, mismatches);
+  if (mismatches)
+    failed = 1;
+
+  for (i = 0; i < MUTATIONS; i++) {
+    memcpy(desc, ds4_descriptor, sizeof(desc));
+    for (j = rand() % 4; j >= 0; j--)
+      desc[rand() % sizeof(desc)] = rand();
+    if (HIDPlanCompile(&plan, desc, sizeof(desc), PS4Device.hid_buttons) < 0) {
+      refused++;
+      continue;
+    }
+    if (!PlanInBounds(&plan)) {
+      fprintf(stderr, "Mutated descriptor %d compiled to ops out of bounds:", i);
+      for (j = 0; j < (int)sizeof(desc); j++)
+        fprintf(stderr, " %02x", desc[j]);
+      fprintf(stderr, "\n");
+      failed = 1;
+      break;
+    }
+  }
+  printf("%d mutated descriptors, %d refused\n", i, refused);
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
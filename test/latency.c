@@ -0,0 +1,518 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-handler.h"
+#include "../device-types.h"
+#include "../orientation.h"
+#include "../timesync.h"
+#include "../latency-probe.h"
+#include "../flight-recorder.h"
+#include "../metrics.h"
+#include "../pad.h"
+#include "../output.h"
+#include "fake-device.h"
+
+// End to end latency of the controller handlers: Emulated controllers send
+// reports, the real handler code decodes them and writes frames to the
+// uinput stand-in, which measures the time from report to frame. Rumble
+// effects are played through the stand-in like a game would, the time until
+// the emulated device has the output report is the rumble round trip. The
+// bus itself is modelled with fixed transfer times, so what is measured is
+// the time the driver adds. The same controller model is also run without
+// interrupt OUT endpoint and with one that stalls, to compare the interrupt
+// and control pipes. Fails if a frame gets lost, an output report is wrong
+// or the 99th percentile of frames (90th of rumble plays, as there are few)
+// is over budget.
+//
+// With -n the table is replaced by a run of that many plain controllers,
+// once with the frames written event by event as before they were batched
+// and once with one write per frame, comparing writes, CPU time per report
+// and latency.
+
+#define SETTLE_TIMEOUT_MS 5000
+#define RUMBLE_PLAYS      40
+#define RUMBLE_GAP_MS     5
+#define RUMBLE_TIMEOUT_MS 1000
+#define BURST_REPORTS     4      // Reports per burst of the bursty controller
+#define BURST_GAP_US      250    // Time between reports of a burst, at most
+#define BURST_STEPS       1024
+#define CLOSE_CANCEL_MS   1200   // Cancel time of the device in the close test
+
+// How an emulated controller deviates from a plain periodic one
+#define SETUP_PERIODIC  0
+#define SETUP_BURSTS    1        // Programmed schedule of bursts first
+#define SETUP_NO_OUT    2        // No interrupt OUT endpoint
+#define SETUP_OUT_STALL 3        // Interrupt OUT endpoint stalls
+
+static const struct {
+  const char *name;
+  uint16_t product;
+  int setup;
+  int path;               // Pipe the rumble has to go over (0 = interrupt, 1 = control)
+} controllers[] = {
+  {"PS3", 0x0268, SETUP_PERIODIC, 1},
+  {"PS4", 0x05c4, SETUP_PERIODIC, 0},
+  {"PS4v2", 0x09cc, SETUP_PERIODIC, 0},
+  {"burst", 0x05c4, SETUP_BURSTS, 0},
+  {"PS4ctl", 0x05c4, SETUP_NO_OUT, 1},
+  {"stall", 0x05c4, SETUP_OUT_STALL, 1}
+};
+#define CONTROLLERS (sizeof(controllers) / sizeof(controllers[0]))
+
+struct RumbleResult {
+  int count;
+  int failed;
+  int path;
+  int64_t round_trip_ns[RUMBLE_PLAYS];
+};
+
+static struct FakeStep burst_schedule[BURST_STEPS];
+
+static void SleepMs(int ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static int CompareInt64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Reports come in bursts with the same average rate as the periodic ones
+static void SetupBursts(int interval_us) {
+  int gap_us = interval_us < BURST_GAP_US ? interval_us / 2 : BURST_GAP_US;
+  int i;
+
+  for (i = 0; i < BURST_STEPS; i++) {
+    burst_schedule[i].at_us = (int64_t)(i / BURST_REPORTS) * BURST_REPORTS * interval_us +
+                              (i % BURST_REPORTS) * gap_us;
+    burst_schedule[i].result = 0;
+    burst_schedule[i].length = 0;
+    burst_schedule[i].data = NULL;
+  }
+}
+
+static void SetupDevice(struct FakeDevice *dev, int setup) {
+  switch (setup) {
+  case SETUP_BURSTS:
+    dev->schedule = burst_schedule;
+    dev->steps = BURST_STEPS;
+    break;
+  case SETUP_NO_OUT:
+    dev->endpoint_out = 0;
+    break;
+  case SETUP_OUT_STALL:
+    dev->out_status = LIBUSB_TRANSFER_STALL;
+    break;
+  }
+}
+
+static int StartHandler(struct FakeDevice *dev, const struct UinputProfile *profile) {
+  struct Pad *pad = PadAlloc();
+  pthread_attr_t tattr;
+  pthread_t tid;
+
+  if (pad == NULL)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &pad->attach_time);
+  pad->args.busnum = dev->busnum;
+  pad->args.devnum = dev->devnum;
+  pad->args.type = dev->type;
+  pad->output_policy = OUTPUT_ALL;
+  pad->profile = profile;
+
+  if (PadThreadAttrInit(&tattr) != 0) {
+    PadFree(pad);
+    return -1;
+  }
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&tid, &tattr, &DeviceHandlerThreadUSB, (void *)pad);
+  pthread_attr_destroy(&tattr);
+  if (ret != 0) {
+    PadFree(pad);
+    return -1;
+  }
+  return 0;
+}
+
+// Checks the motor bytes of the output report the device got
+static int RumbleReportOk(struct FakeDevice *dev, const unsigned char *output,
+                          int strong, int weak) {
+  if (dev->type->product == 0x0268)
+    return output[0] == 0x01 && output[3] == (weak ? 1 : 0) && output[5] == strong / 256;
+  return output[0] == 0x05 && output[4] == weak / 256 && output[5] == strong / 256;
+}
+
+// Plays an effect on and off and measures the time from each EV_FF event
+// to the output report arriving at the device
+static void Rumble(struct FakeDevice *dev, struct RumbleResult *result) {
+  unsigned char output[FAKE_OUTPUT_SIZE];
+  int strong = 0xc000, weak = 0x4000;
+  int i, ms;
+
+  if (FakeUinputUpload(dev, 0, strong, weak) < 0) {
+    result->failed++;
+    return;
+  }
+
+  for (i = 0; i < RUMBLE_PLAYS; i++) {
+    int value = !(i & 1);
+    int64_t done_ns;
+    uint64_t before = FakeDeviceOutput(dev, NULL, NULL, NULL);
+    int64_t play_ns = FakeUinputPlay(dev, 0, value);
+    if (play_ns < 0) {
+      result->failed++;
+      return;
+    }
+    for (ms = 0; ms < RUMBLE_TIMEOUT_MS * 10; ms++) {
+      if (FakeDeviceOutput(dev, output, &result->path, &done_ns) != before)
+        break;
+      usleep(100);
+    }
+    if (ms == RUMBLE_TIMEOUT_MS * 10 ||
+        !RumbleReportOk(dev, output, value ? strong : 0, value ? weak : 0))
+      result->failed++;
+    else
+      result->round_trip_ns[result->count++] = done_ns - play_ns;
+    SleepMs(RUMBLE_GAP_MS);
+  }
+}
+
+// Removes a controller while its rumble transfer is still in flight on a
+// device which takes its time to cancel. The handler must wait for the
+// transfer instead of closing under it.
+static int TestCloseWhileBusy(const struct UinputProfile *profile) {
+  const struct DeviceType *type = DeviceTypeLookup(USB_VENDOR_ID_SONY, 0x05c4);
+  struct FakeDevice *dev = FakeDevicePlug(1, 99, type, 1000);
+  int ms;
+
+  if (dev == NULL)
+    return -1;
+  dev->out_delay_ns = 10 * 1000000000LL;
+  dev->cancel_delay_ns = CLOSE_CANCEL_MS * 1000000LL;
+  if (StartHandler(dev, profile) < 0)
+    return -1;
+  for (ms = 0; ms < SETTLE_TIMEOUT_MS && FakeDeviceReports(dev) == 0; ms++)
+    SleepMs(1);
+  if (FakeUinputUpload(dev, 0, 0xffff, 0xffff) < 0 || FakeUinputPlay(dev, 0, 1) < 0)
+    return -1;
+  SleepMs(10);
+
+  int64_t removed_ns = FakeNowNs();
+  PadRemoved(dev->busnum, dev->devnum);
+  for (ms = 0; ms < SETTLE_TIMEOUT_MS && PadCount() > 0; ms++)
+    SleepMs(1);
+  int waited_ms = (FakeNowNs() - removed_ns) / 1000000;
+  FakeDeviceUnplug(dev);
+
+  int ret = 0;
+  if (PadCount() > 0 || FakeDeviceOpenHandles(dev) != 0 || dev->busy_at_close) {
+    fprintf(stderr, "close: handle closed with transfer in flight\n");
+    ret = -1;
+  }
+  else if (waited_ms < CLOSE_CANCEL_MS) {
+    fprintf(stderr, "close: handler did not wait for the cancelled transfer\n");
+    ret = -1;
+  }
+  else
+    printf("close: waited %d ms for the cancelled transfer\n", waited_ms);
+  FakeDeviceRelease(dev);
+  return ret;
+}
+
+static int64_t CpuNs() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+// Runs "count" controllers for a while, the frames written event by event
+// or batched. Reports, writes and CPU time are counted once all of them run,
+// the latency percentiles are the highest of any controller.
+static int RunPads(int count, int event_writes, int seconds, int interval_us, int budget_us,
+                   const struct UinputProfile *profile) {
+  const struct DeviceType *type = DeviceTypeLookup(USB_VENDOR_ID_SONY, 0x05c4);
+  struct FakeDevice *devs[FAKE_MAX_DEVICES];
+  uint64_t reports = 0;
+  int p50 = 0, p99 = 0;
+  int failed = 0;
+  int i, ms;
+
+  fake_uinput_event_writes = event_writes;
+  for (i = 0; i < count; i++) {
+    devs[i] = FakeDevicePlug(2, i + 2, type, interval_us);
+    if (!devs[i] || StartHandler(devs[i], profile) < 0) {
+      fprintf(stderr, "Can't start handler %d\n", i);
+      return -1;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    for (ms = 0; ms < SETTLE_TIMEOUT_MS && FakeDeviceReports(devs[i]) == 0; ms++)
+      SleepMs(1);
+  }
+
+  // Measured once all of them run
+  uint32_t first[FAKE_MAX_DEVICES];
+  for (i = 0; i < count; i++)
+    first[i] = FakeDeviceReports(devs[i]);
+  uint64_t writes = __atomic_load_n(&fake_uinput_writes, __ATOMIC_RELAXED);
+  int64_t cpu_ns = CpuNs();
+  SleepMs(seconds * 1000);
+  cpu_ns = CpuNs() - cpu_ns;
+  writes = __atomic_load_n(&fake_uinput_writes, __ATOMIC_RELAXED) - writes;
+  for (i = 0; i < count; i++)
+    reports += FakeDeviceReports(devs[i]) - first[i];
+
+  for (i = 0; i < count; i++) {
+    FakeDeviceUnplug(devs[i]);
+    PadRemoved(devs[i]->busnum, devs[i]->devnum);
+  }
+  for (ms = 0; ms < SETTLE_TIMEOUT_MS && PadCount() > 0; ms++)
+    SleepMs(1);
+  if (PadCount() > 0) {
+    fprintf(stderr, "Handlers did not exit after unplug\n");
+    return -1;
+  }
+  SleepMs(100);
+
+  for (i = 0; i < count; i++) {
+    struct FakeDevice *dev = devs[i];
+    int p = FakeUinputLatencyUs(dev, 50);
+    if (p > p50)
+      p50 = p;
+    p = FakeUinputLatencyUs(dev, 99);
+    if (p > p99)
+      p99 = p;
+    if (dev->frames != FakeDeviceReports(dev) || dev->frames_lost || dev->frames_unmatched ||
+        FakeDeviceOpenHandles(dev) != 0) {
+      fprintf(stderr, "Controller %d: %llu frames for %u reports\n", i,
+              (unsigned long long)dev->frames, FakeDeviceReports(dev));
+      failed = 1;
+    }
+    FakeDeviceRelease(dev);
+  }
+
+  printf("%-6s %5d %9llu %8.1f %9.2f %8d %8d\n",
+         event_writes ? "event" : "frame", count, (unsigned long long)reports,
+         reports ? (double)writes / reports : 0.0,
+         reports ? cpu_ns / 1000.0 / reports : 0.0, p50, p99);
+  // The writes event by event are only there to compare with
+  if (!event_writes && budget_us && p99 > budget_us) {
+    fprintf(stderr, "99th percentile %d us over budget of %d us\n", p99, budget_us);
+    failed = 1;
+  }
+  return failed ? -1 : 0;
+}
+
+static void Usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-t SECONDS] [-i INTERVAL_US] [-b BUDGET_US] [-n PADS]\n"
+                  "  -t SECONDS      Run time (default 2)\n"
+                  "  -i INTERVAL_US  Report interval of the controllers (default 1000)\n"
+                  "  -b BUDGET_US    Fail if a 99th percentile is higher (default 5000, 0 = off)\n"
+                  "  -n PADS         Compare frame writes with that many controllers instead\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  struct FakeDevice *devs[CONTROLLERS];
+  struct RumbleResult rumble[CONTROLLERS];
+  int seconds = 2;
+  int interval_us = 1000;
+  int budget_us = 5000;
+  int pads = 0;
+  int failed = 0;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "t:i:b:n:")) != -1) {
+    switch (opt) {
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    case 'i':
+      interval_us = atoi(optarg);
+      break;
+    case 'b':
+      budget_us = atoi(optarg);
+      break;
+    case 'n':
+      pads = atoi(optarg);
+      break;
+    default:
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+  if (seconds < 1 || interval_us < 100 || budget_us < 0 ||
+      pads < 0 || pads > FAKE_MAX_DEVICES) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  openlog("latency", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_WARNING));
+  signal(SIGPIPE, SIG_IGN);
+  DeviceTypesInit();
+  UinputProfilesInit();
+  SetupBursts(interval_us);
+
+  // Raw sticks, so each frame can be matched with its report
+  const struct UinputProfile *profile = UinputProfileLookup("ds4");
+
+  if (pads) {
+    printf("%-6s %5s %9s %8s %9s %8s %8s\n", "writes", "pads", "reports", "writes/r",
+           "cpu us/r", "p50 us", "p99 us");
+    if (RunPads(pads, 1, seconds, interval_us, budget_us, profile) < 0)
+      failed = 1;
+    if (RunPads(pads, 0, seconds, interval_us, budget_us, profile) < 0)
+      failed = 1;
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+  }
+
+  for (i = 0; i < CONTROLLERS; i++) {
+    const struct DeviceType *type = DeviceTypeLookup(USB_VENDOR_ID_SONY, controllers[i].product);
+    devs[i] = type ? FakeDevicePlug(1, i + 2, type, interval_us) : NULL;
+    if (devs[i])
+      SetupDevice(devs[i], controllers[i].setup);
+    if (!devs[i] || StartHandler(devs[i], profile) < 0) {
+      fprintf(stderr, "Can't start handler for %s\n", controllers[i].name);
+      return 1;
+    }
+  }
+
+  // Rumble while the reports keep coming
+  int64_t end_ns = FakeNowNs() + seconds * 1000000000LL;
+  memset(rumble, 0, sizeof(rumble));
+  for (i = 0; i < CONTROLLERS; i++) {
+    int ms;
+    for (ms = 0; ms < SETTLE_TIMEOUT_MS && FakeDeviceReports(devs[i]) == 0; ms++)
+      SleepMs(1);
+    Rumble(devs[i], &rumble[i]);
+  }
+  int64_t left_ns = end_ns - FakeNowNs();
+  if (left_ns > 0)
+    SleepMs(left_ns / 1000000);
+
+  for (i = 0; i < CONTROLLERS; i++) {
+    FakeDeviceUnplug(devs[i]);
+    PadRemoved(devs[i]->busnum, devs[i]->devnum);
+  }
+  for (i = 0; i < SETTLE_TIMEOUT_MS && PadCount() > 0; i++)
+    SleepMs(1);
+  if (PadCount() > 0) {
+    fprintf(stderr, "Handlers did not exit after unplug\n");
+    return 1;
+  }
+  // Let the reader drain the last frames
+  SleepMs(100);
+
+  int64_t paths[2][CONTROLLERS * RUMBLE_PLAYS];
+  int path_plays[2] = {0, 0};
+
+  printf("%-6s %8s %8s %6s %9s %8s %8s %8s   %-9s %6s %8s %8s\n",
+         "", "reports", "frames", "lost", "unmatched", "p50 us", "p99 us", "max us",
+         "rumble", "plays", "p50 us", "max us");
+  for (i = 0; i < CONTROLLERS; i++) {
+    struct FakeDevice *dev = devs[i];
+    struct RumbleResult *r = &rumble[i];
+    uint32_t reports = FakeDeviceReports(dev);
+    int p50 = FakeUinputLatencyUs(dev, 50);
+    int p99 = FakeUinputLatencyUs(dev, 99);
+    int64_t rumble_p50 = 0, rumble_p90 = 0, rumble_max = 0;
+    if (r->count) {
+      qsort(r->round_trip_ns, r->count, sizeof(int64_t), CompareInt64);
+      rumble_p50 = r->round_trip_ns[r->count / 2];
+      rumble_p90 = r->round_trip_ns[r->count * 9 / 10];
+      rumble_max = r->round_trip_ns[r->count - 1];
+    }
+    printf("%-6s %8u %8llu %6llu %9llu %8d %8d %8lld   %-9s %6d %8lld %8lld\n",
+           controllers[i].name, reports,
+           (unsigned long long)dev->frames, (unsigned long long)dev->frames_lost,
+           (unsigned long long)dev->frames_unmatched, p50, p99,
+           (long long)(dev->latency_max_ns / 1000),
+           r->path ? "control" : "interrupt", r->count,
+           (long long)(rumble_p50 / 1000), (long long)(rumble_max / 1000));
+
+    // Every report changes the sticks, so each one has to make a frame
+    if (reports == 0 || dev->frames != reports || dev->frames_lost || dev->frames_unmatched) {
+      fprintf(stderr, "%s: frames lost\n", controllers[i].name);
+      failed = 1;
+    }
+    if (budget_us && p99 > budget_us) {
+      fprintf(stderr, "%s: 99th percentile %d us over budget of %d us\n",
+              controllers[i].name, p99, budget_us);
+      failed = 1;
+    }
+    if (r->failed || dev->outputs_bad) {
+      fprintf(stderr, "%s: %d rumble plays without the right output report\n",
+              controllers[i].name, r->failed + (int)dev->outputs_bad);
+      failed = 1;
+    }
+    memcpy(paths[r->path] + path_plays[r->path], r->round_trip_ns, r->count * sizeof(int64_t));
+    path_plays[r->path] += r->count;
+    if (r->path != controllers[i].path) {
+      fprintf(stderr, "%s: rumble went over the wrong pipe\n", controllers[i].name);
+      failed = 1;
+    }
+    if (budget_us && rumble_p90 > budget_us * 1000LL) {
+      fprintf(stderr, "%s: 90th percentile of rumble round trip %lld us over budget of %d us\n",
+              controllers[i].name, (long long)(rumble_p90 / 1000), budget_us);
+      failed = 1;
+    }
+    if (dev->type->init && dev->feature_reads == 0) {
+      fprintf(stderr, "%s: controller was not enabled\n", controllers[i].name);
+      failed = 1;
+    }
+    if (FakeDeviceOpenHandles(dev) != 0 || dev->busy_at_close) {
+      fprintf(stderr, "%s: device handle left open or closed while busy\n", controllers[i].name);
+      failed = 1;
+    }
+    FakeDeviceRelease(dev);
+  }
+
+  // Same plays by pipe. The bus time of both is the same in the emulation.
+  for (i = 0; i < 2; i++) {
+    if (!path_plays[i])
+      continue;
+    qsort(paths[i], path_plays[i], sizeof(int64_t), CompareInt64);
+    printf("rumble over %-9s pipe: %3d plays, p50 %lld us, p90 %lld us, max %lld us\n",
+           i ? "control" : "interrupt", path_plays[i],
+           (long long)(paths[i][path_plays[i] / 2] / 1000),
+           (long long)(paths[i][path_plays[i] * 9 / 10] / 1000),
+           (long long)(paths[i][path_plays[i] - 1] / 1000));
+  }
+
+  if (TestCloseWhileBusy(profile) < 0)
+    failed = 1;
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
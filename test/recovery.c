@@ -0,0 +1,350 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-handler.h"
+#include "../device-types.h"
+#include "../orientation.h"
+#include "../timesync.h"
+#include "../latency-probe.h"
+#include "../flight-recorder.h"
+#include "../metrics.h"
+#include "../pad.h"
+#include "../output.h"
+#include "../recovery.h"
+#include "fake-device.h"
+
+// USB error recovery of the controller handlers: Emulated controllers fail
+// on a programmed schedule and the real handler code has to get them
+// working again in place, escalate from clearing the halt to a reset, or
+// give them up. Checks the recovery state in the middle of each incident,
+// the counters afterwards and that no frame got lost or made up.
+
+#define INTERVAL_US       1000
+#define MID_CHECK_MS      300    // Incidents are going on or waiting for reports
+#define FINAL_CHECK_MS    700    // Everything recovered or given up
+#define SETTLE_TIMEOUT_MS 5000
+#define MAX_STEPS         64
+#define STALL_GAP_MS      200    // Silence of the stalled controller
+#define WATCHDOG_SLACK_MS 15     // Allowed over 20 ms for detecting the stall
+
+struct Scenario {
+  const char *name;
+  uint16_t product;
+  int clear_halt_result;
+  int reset_result;
+  int timeout_cap_ms;
+
+  // Expected outcome. The handler either gives the pad up or is in
+  // "mid_state" at the middle and back to normal at the end.
+  int exits;
+  int mid_state;
+  unsigned long incidents;
+  unsigned long recoveries;
+  int clear_halts;
+  int resets;
+  int feature_reads;
+  uint64_t short_reports;
+  uint64_t read_timeouts;       // At least
+  int usb_error;                // Error counted "usb_errors" times
+  uint64_t usb_errors;
+
+  struct FakeStep steps[MAX_STEPS];
+  int count;
+};
+
+static struct Scenario scenarios[] = {
+  // Stalled endpoint, clearing the halt helps
+  {"pipe", 0x05c4, 0, 0, 0,
+   0, RECOVERY_OK, 1, 1, 1, 0, 0, 0, 0, LIBUSB_ERROR_PIPE, 1},
+  // Halt can't be cleared, the reset and init of the device help
+  {"escalate", 0x0268, LIBUSB_ERROR_IO, 0, 0,
+   0, RECOVERY_OK, 1, 1, 2, 1, 2, 0, 0, LIBUSB_ERROR_PIPE, 3},
+  // Transfer errors in a row are one incident
+  {"io", 0x05c4, 0, 0, 0,
+   0, RECOVERY_OK, 1, 1, 2, 0, 0, 0, 0, LIBUSB_ERROR_OVERFLOW, 1},
+  // Controller goes silent, the watchdog notices
+  {"stall", 0x05c4, 0, 0, 0,
+   0, RECOVERY_OK, 1, 1, 1, 0, 0, 0, 1, 0, 0},
+  // Silent for good, nothing left to try but waiting for reports
+  {"wait", 0x05c4, 0, 0, 50,
+   0, RECOVERY_WAIT, 1, 1, 2, 1, 0, 0, 4, 0, 0},
+  // No reports before the watchdog is armed is no incident
+  {"idle", 0x0268, 0, 0, 50,
+   0, RECOVERY_OK, 0, 0, 0, 0, 1, 0, 3, 0, 0},
+  // Short reports are dropped
+  {"short", 0x05c4, 0, 0, 0,
+   0, RECOVERY_OK, 0, 0, 0, 0, 0, 10, 0, 0, 0},
+  // Unplugged, the handler tears down without any recovery
+  {"gone", 0x05c4, 0, 0, 0,
+   1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+  // Device got enumerated again by the reset, it has to be given up
+  {"reset", 0x05c4, LIBUSB_ERROR_IO, LIBUSB_ERROR_NOT_FOUND, 0,
+   1, 0, 0, 0, 2, 1, 0, 0, 0, 0, 0}
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void SleepMs(int ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static void Step(struct Scenario *s, int at_us, int result, int length) {
+  struct FakeStep *step = &s->steps[s->count++];
+  step->at_us = at_us;
+  step->result = result;
+  step->length = length;
+  step->data = NULL;
+}
+
+// Generated reports, "count" of them from "from_us" on
+static void Reports(struct Scenario *s, int from_us, int count) {
+  int i;
+  for (i = 0; i < count; i++)
+    Step(s, from_us + i * INTERVAL_US, 0, 0);
+}
+
+// Each one gets 20 good reports first, which arms the watchdog. Periodic
+// reports follow the schedule.
+static void SetupSchedules() {
+  struct Scenario *s;
+
+  s = &scenarios[0];                    // pipe
+  Reports(s, 0, 20);
+  Step(s, 25000, LIBUSB_ERROR_PIPE, 0);
+
+  s = &scenarios[1];                    // escalate
+  Reports(s, 0, 20);
+  Step(s, 25000, LIBUSB_ERROR_PIPE, 0);
+
+  s = &scenarios[2];                    // io
+  Reports(s, 0, 20);
+  Step(s, 25000, LIBUSB_ERROR_IO, 0);
+  Step(s, 26000, LIBUSB_ERROR_OVERFLOW, 0);
+
+  s = &scenarios[3];                    // stall
+  Reports(s, 0, 20);
+  Reports(s, 19000 + STALL_GAP_MS * 1000, 20);
+
+  s = &scenarios[4];                    // wait
+  Reports(s, 0, 20);
+  Reports(s, (MID_CHECK_MS + 100) * 1000, 20);
+
+  s = &scenarios[5];                    // idle
+  Reports(s, MID_CHECK_MS * 1000 - 100000, 20);
+
+  s = &scenarios[6];                    // short
+  int i;
+  for (i = 0; i < 30; i++)
+    Step(s, i * INTERVAL_US, 0, i % 3 == 2 ? 10 : 0);
+
+  s = &scenarios[7];                    // gone
+  Reports(s, 0, 20);
+  Step(s, 25000, LIBUSB_ERROR_NO_DEVICE, 0);
+
+  s = &scenarios[8];                    // reset
+  Reports(s, 0, 20);
+  Step(s, 25000, LIBUSB_ERROR_PIPE, 0);
+}
+
+static struct Pad *StartHandler(struct FakeDevice *dev, const struct UinputProfile *profile) {
+  struct Pad *pad = PadAlloc();
+  pthread_attr_t tattr;
+  pthread_t tid;
+
+  if (pad == NULL)
+    return NULL;
+  clock_gettime(CLOCK_MONOTONIC, &pad->attach_time);
+  pad->args.busnum = dev->busnum;
+  pad->args.devnum = dev->devnum;
+  pad->args.type = dev->type;
+  pad->output_policy = OUTPUT_ALL;
+  pad->profile = profile;
+
+  if (PadThreadAttrInit(&tattr) != 0) {
+    PadFree(pad);
+    return NULL;
+  }
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&tid, &tattr, &DeviceHandlerThreadUSB, (void *)pad);
+  pthread_attr_destroy(&tattr);
+  if (ret != 0) {
+    PadFree(pad);
+    return NULL;
+  }
+  return pad;
+}
+
+static int Expect(const struct Scenario *s, const char *what, long long value, long long expected) {
+  if (value == expected)
+    return 0;
+  fprintf(stderr, "%s: %s is %lld, expected %lld\n", s->name, what, value, expected);
+  return 1;
+}
+
+// Counters of a running handler after its incidents
+static int CheckPad(const struct Scenario *s, const struct Pad *pad) {
+  int failed = 0;
+
+  failed |= Expect(s, "recovery state", pad->recovery_state, RECOVERY_OK);
+  failed |= Expect(s, "incidents", pad->incidents, s->incidents);
+  failed |= Expect(s, "recoveries", pad->recoveries, s->recoveries);
+  failed |= Expect(s, "short reports", pad->metrics.short_reports, s->short_reports);
+  if (pad->metrics.read_timeouts < s->read_timeouts)
+    failed |= Expect(s, "read timeouts", pad->metrics.read_timeouts, s->read_timeouts);
+  if (s->usb_error)
+    failed |= Expect(s, libusb_error_name(s->usb_error),
+                     pad->metrics.usb_errors[-s->usb_error], s->usb_errors);
+  if (s->recoveries && pad->recovery_max_ns <= 0)
+    failed |= Expect(s, "recovery time", pad->recovery_max_ns, 1);
+  return failed;
+}
+
+// Fake side of the incidents, also for handlers which are gone
+static int CheckDevice(const struct Scenario *s, struct FakeDevice *dev) {
+  int failed = 0;
+
+  failed |= Expect(s, "clear halts", dev->clear_halts, s->clear_halts);
+  failed |= Expect(s, "resets", dev->resets, s->resets);
+  if (s->feature_reads)
+    failed |= Expect(s, "enable requests", dev->feature_reads, s->feature_reads);
+  return failed;
+}
+
+int main() {
+  struct FakeDevice *devs[SCENARIOS];
+  struct Pad *pads[SCENARIOS];
+  int failed = 0;
+  int i, ms;
+
+  openlog("recovery", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_ERR));
+  signal(SIGPIPE, SIG_IGN);
+  DeviceTypesInit();
+  UinputProfilesInit();
+  SetupSchedules();
+
+  // Raw sticks, so each frame can be matched with its report
+  const struct UinputProfile *profile = UinputProfileLookup("ds4");
+
+  for (i = 0; i < SCENARIOS; i++) {
+    struct Scenario *s = &scenarios[i];
+    const struct DeviceType *type = DeviceTypeLookup(USB_VENDOR_ID_SONY, s->product);
+    devs[i] = type ? FakeDevicePlug(1, i + 2, type, INTERVAL_US) : NULL;
+    if (devs[i] == NULL) {
+      fprintf(stderr, "Can't plug %s\n", s->name);
+      return 1;
+    }
+    devs[i]->schedule = s->steps;
+    devs[i]->steps = s->count;
+    devs[i]->clear_halt_result = s->clear_halt_result;
+    devs[i]->reset_result = s->reset_result;
+    devs[i]->timeout_cap_ms = s->timeout_cap_ms;
+    pads[i] = StartHandler(devs[i], profile);
+    if (pads[i] == NULL) {
+      fprintf(stderr, "Can't start handler for %s\n", s->name);
+      return 1;
+    }
+  }
+
+  SleepMs(MID_CHECK_MS);
+  for (i = 0; i < SCENARIOS; i++) {
+    if (!scenarios[i].exits)
+      failed |= Expect(&scenarios[i], "recovery state in the middle",
+                       pads[i]->recovery_state, scenarios[i].mid_state);
+  }
+
+  SleepMs(FINAL_CHECK_MS - MID_CHECK_MS);
+  printf("%-9s %8s %9s %10s %6s %6s %8s %8s %7s\n", "", "reports", "incidents", "recoveries",
+         "clears", "resets", "short", "timeouts", "max ms");
+  for (i = 0; i < SCENARIOS; i++) {
+    struct Scenario *s = &scenarios[i];
+    struct FakeDevice *dev = devs[i];
+
+    if (s->exits) {
+      // Handler has to be gone by now without being told
+      if (FakeDeviceOpenHandles(dev) != 0) {
+        fprintf(stderr, "%s: handler did not give the controller up\n", s->name);
+        failed = 1;
+      }
+      printf("%-9s %8u %9s\n", s->name, FakeDeviceReports(dev), "gave up");
+    }
+    else {
+      const struct Pad *pad = pads[i];
+      printf("%-9s %8u %9lu %10lu %6d %6d %8llu %8llu %7lld\n", s->name,
+             FakeDeviceReports(dev), pad->incidents, pad->recoveries,
+             dev->clear_halts, dev->resets,
+             (unsigned long long)pad->metrics.short_reports,
+             (unsigned long long)pad->metrics.read_timeouts,
+             (long long)(pad->recovery_max_ns / 1000000));
+      failed |= CheckPad(s, pad);
+
+      // Stall has to be noticed within a few report intervals of the last
+      // report, the rest of the gap is the recovery time
+      if (s == &scenarios[3]) {
+        int detect_ms = STALL_GAP_MS - pad->recovery_max_ns / 1000000;
+        if (detect_ms > 20 + WATCHDOG_SLACK_MS) {
+          fprintf(stderr, "%s: stall noticed after %d ms\n", s->name, detect_ms);
+          failed = 1;
+        }
+      }
+    }
+    failed |= CheckDevice(s, dev);
+  }
+
+  for (i = 0; i < SCENARIOS; i++) {
+    FakeDeviceUnplug(devs[i]);
+    PadRemoved(devs[i]->busnum, devs[i]->devnum);
+  }
+  for (ms = 0; ms < SETTLE_TIMEOUT_MS && PadCount() > 0; ms++)
+    SleepMs(1);
+  if (PadCount() > 0) {
+    fprintf(stderr, "Handlers did not exit after unplug\n");
+    return 1;
+  }
+  // Let the reader drain the last frames
+  SleepMs(100);
+
+  // The last good state stays through each incident: no frame may get lost
+  // or be made up
+  for (i = 0; i < SCENARIOS; i++) {
+    struct FakeDevice *dev = devs[i];
+    if (dev->frames != FakeDeviceReports(dev) || dev->frames_lost || dev->frames_unmatched) {
+      fprintf(stderr, "%s: %llu frames for %u reports\n", scenarios[i].name,
+              (unsigned long long)dev->frames, FakeDeviceReports(dev));
+      failed = 1;
+    }
+    if (FakeDeviceOpenHandles(dev) != 0 || dev->busy_at_close) {
+      fprintf(stderr, "%s: device handle left open\n", scenarios[i].name);
+      failed = 1;
+    }
+    FakeDeviceRelease(dev);
+  }
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
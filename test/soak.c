@@ -0,0 +1,295 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "../usb.h"
+#include "../uinput.h"
+#include "../device-types.h"
+#include "../ps3-device.h"
+#include "../ps4-device.h"
+#include "../orientation.h"
+#include "../timesync.h"
+#include "../latency-probe.h"
+#include "../flight-recorder.h"
+#include "../metrics.h"
+#include "../pad.h"
+#include "fake-device.h"
+
+// Hotplug soak test: Runs the real daemon (main.c, built as PspaddrvMain)
+// against the fake udev monitor and plugs emulated controllers in and out
+// thousands of times. Fails if file descriptors, threads or resident memory
+// grow over the baseline taken after the warmup cycles.
+
+#define PADS_PER_CYCLE      2
+#define REPORT_INTERVAL_US  1000
+#define CHECKPOINT_CYCLES   250
+#define TIMEOUT_MS          5000
+#define SETTLE_SAMPLES      5     // Thread count unchanged for this many polls
+
+int PspaddrvMain(int argc, char *argv[]);
+
+static const struct DeviceType *types[] = {
+  &PS3Device,
+  &PS4Device,
+  &PS4v2Device
+};
+#define TYPES (sizeof(types) / sizeof(types[0]))
+
+static int driver_argc;
+static char **driver_argv;
+
+static int attach_count = 0;
+static int *attach_us = NULL;
+
+static void *DriverThread(void *arg) {
+  PspaddrvMain(driver_argc, driver_argv);
+  fprintf(stderr, "Driver exited\n");
+  exit(1);
+  return NULL;
+}
+
+static void SleepUs(int us) {
+  struct timespec ts = {us / 1000000, (us % 1000000) * 1000L};
+  nanosleep(&ts, NULL);
+}
+
+static void SleepMs(int ms) {
+  SleepUs(ms * 1000);
+}
+
+// Waits until the driver handled all events and all handlers are gone
+static int WaitIdle() {
+  int i;
+  for (i = 0; i < TIMEOUT_MS; i++) {
+    if (FakeUdevPending() == 0 && PadCount() == 0)
+      return 0;
+    SleepMs(1);
+  }
+  return -1;
+}
+
+// Waits for idle and for exiting threads to be gone, then takes a sample
+static int Quiesce(struct ProcessUsage *usage) {
+  struct ProcessUsage last;
+  int stable = 0;
+  int i;
+
+  if (WaitIdle() < 0 || PadGetProcessUsage(&last) < 0)
+    return -1;
+  for (i = 0; i < TIMEOUT_MS / 10 && stable < SETTLE_SAMPLES; i++) {
+    SleepMs(10);
+    if (PadGetProcessUsage(usage) < 0)
+      return -1;
+    stable = (usage->threads == last.threads && usage->fds == last.fds) ? stable + 1 : 0;
+    last = *usage;
+  }
+  return 0;
+}
+
+// One hotplug cycle. Most cycles wait for the first report, some remove the
+// controllers again right away to hit the setup paths. Either the udev event
+// or the failing transfers may come first, like on real hardware.
+static int Cycle(int cycle) {
+  struct FakeDevice *devs[PADS_PER_CYCLE];
+  int64_t plugged[PADS_PER_CYCLE];
+  int early = (cycle % 8 == 7);
+  int udev_first = (cycle % 4 == 1);
+  int i, us;
+
+  for (i = 0; i < PADS_PER_CYCLE; i++) {
+    int devnum = 2 + (cycle * PADS_PER_CYCLE + i) % 120;
+    devs[i] = FakeDevicePlug(1, devnum, types[(cycle + i) % TYPES], REPORT_INTERVAL_US);
+    if (devs[i] == NULL) {
+      fprintf(stderr, "Cycle %d: no free emulated device\n", cycle);
+      return -1;
+    }
+    plugged[i] = FakeNowNs();
+    FakeUdevEvent("add", devs[i]);
+  }
+
+  for (i = 0; i < PADS_PER_CYCLE && !early; i++) {
+    for (us = 0; us < TIMEOUT_MS * 1000 && FakeDeviceReports(devs[i]) == 0; us += 50)
+      SleepUs(50);
+    if (FakeDeviceReports(devs[i]) == 0) {
+      fprintf(stderr, "Cycle %d: controller %03d/%03d never read\n",
+              cycle, devs[i]->busnum, devs[i]->devnum);
+      return -1;
+    }
+    if (attach_us)
+      attach_us[attach_count++] = (FakeNowNs() - plugged[i]) / 1000;
+  }
+
+  for (i = 0; i < PADS_PER_CYCLE; i++) {
+    if (udev_first) {
+      FakeUdevEvent("remove", devs[i]);
+      FakeDeviceUnplug(devs[i]);
+    }
+    else {
+      FakeDeviceUnplug(devs[i]);
+      FakeUdevEvent("remove", devs[i]);
+    }
+  }
+
+  if (WaitIdle() < 0) {
+    fprintf(stderr, "Cycle %d: handlers did not exit\n", cycle);
+    return -1;
+  }
+  for (i = 0; i < PADS_PER_CYCLE; i++) {
+    if (FakeDeviceOpenHandles(devs[i]) != 0) {
+      fprintf(stderr, "Cycle %d: controller %03d/%03d left open\n",
+              cycle, devs[i]->busnum, devs[i]->devnum);
+      return -1;
+    }
+    FakeDeviceRelease(devs[i]);
+  }
+  return 0;
+}
+
+static int CompareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static void Usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-c CYCLES] [-w WARMUP] [-k RSS_SLACK_KIB] [-- DRIVER_OPTIONS]\n"
+                  "  -c CYCLES         Hotplug cycles after warmup (default 2000)\n"
+                  "  -w WARMUP         Cycles before the baseline is taken (default 100)\n"
+                  "  -k RSS_SLACK_KIB  Resident memory allowed over baseline (default 256)\n",
+          name);
+}
+
+// Returns -1 if usage grew over the baseline
+static int CheckUsage(const struct ProcessUsage *base, const struct ProcessUsage *usage,
+                      int slack_kib, int cycle) {
+  int ret = 0;
+
+  if (usage->fds > base->fds) {
+    fprintf(stderr, "File descriptors grew from %d to %d after %d cycles\n",
+            base->fds, usage->fds, cycle);
+    ret = -1;
+  }
+  if (usage->threads > base->threads) {
+    fprintf(stderr, "Threads grew from %d to %d after %d cycles\n",
+            base->threads, usage->threads, cycle);
+    ret = -1;
+  }
+  if (usage->rss_kib > base->rss_kib + slack_kib) {
+    fprintf(stderr, "Resident memory grew from %ld to %ld KiB after %d cycles\n",
+            base->rss_kib, usage->rss_kib, cycle);
+    ret = -1;
+  }
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  struct ProcessUsage base, usage;
+  pthread_t tid;
+  int cycles = 2000;
+  int warmup = 100;
+  int slack_kib = 256;
+  int failed = 0;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "c:w:k:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cycles = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'k':
+      slack_kib = atoi(optarg);
+      break;
+    default:
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+  if (cycles < 1 || warmup < 1 || slack_kib < 0) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  // Flight recorder off, everything else as given after "--"
+  driver_argc = 3 + argc - optind;
+  driver_argv = calloc(driver_argc + 1, sizeof(char *));
+  attach_us = calloc(cycles * PADS_PER_CYCLE, sizeof(int));
+  if (!driver_argv || !attach_us) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  driver_argv[0] = "pspaddrv";
+  driver_argv[1] = "-R";
+  driver_argv[2] = "";
+  for (i = optind; i < argc; i++)
+    driver_argv[3 + i - optind] = argv[i];
+  optind = 0;
+
+  signal(SIGPIPE, SIG_IGN);
+  if (pthread_create(&tid, NULL, DriverThread, NULL) != 0) {
+    fprintf(stderr, "Can't start driver\n");
+    return 2;
+  }
+
+  int *attach = attach_us;
+  attach_us = NULL;
+  for (i = 0; i < warmup; i++) {
+    if (Cycle(i) < 0)
+      return 1;
+  }
+  if (Quiesce(&base) < 0) {
+    fprintf(stderr, "Driver did not settle after warmup\n");
+    return 1;
+  }
+  attach_us = attach;
+  printf("%8s %10s %8s %6s\n", "cycle", "RSS KiB", "threads", "fds");
+  printf("%8d %10ld %8d %6d\n", 0, base.rss_kib, base.threads, base.fds);
+
+  // Every checkpoint is held against the baseline, so growth which levels
+  // off or gets trimmed later still fails
+  for (i = 0; i < cycles; i++) {
+    if (Cycle(warmup + i) < 0)
+      return 1;
+    if ((i + 1) % CHECKPOINT_CYCLES == 0 || i + 1 == cycles) {
+      if (Quiesce(&usage) < 0) {
+        fprintf(stderr, "Driver did not settle after %d cycles\n", i + 1);
+        return 1;
+      }
+      printf("%8d %10ld %8d %6d\n", i + 1, usage.rss_kib, usage.threads, usage.fds);
+      if (CheckUsage(&base, &usage, slack_kib, i + 1) < 0)
+        failed = 1;
+    }
+  }
+
+  if (attach_count) {
+    qsort(attach_us, attach_count, sizeof(int), CompareInt);
+    printf("attach to first report: p50 %d us, p99 %d us, max %d us (%d attaches)\n",
+           attach_us[attach_count / 2], attach_us[attach_count * 99 / 100],
+           attach_us[attach_count - 1], attach_count);
+  }
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
@@ -0,0 +1,94 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include "usb.h"
+#include "uinput.h"
+#include "device-types.h"
+#include "timesync.h"
+
+// Number of samples per drift estimation window (about 4 s at 250 Hz)
+#define TIMESYNC_WINDOW 1000
+
+// Feeds one device timestamp together with the host time the report was
+// received into the estimator.
+void TimeSyncUpdate(struct TimeSync *ts, const struct DeviceType *type,
+                    uint32_t raw, const struct timespec *host) {
+  int64_t host_ns = host->tv_sec * 1000000000LL + host->tv_nsec;
+  uint64_t wrap = (uint64_t)type->timestamp_mask + 1;
+
+  if (!ts->started) {
+    ts->started = 1;
+    ts->last_raw = raw;
+    ts->last_host_ns = host_ns;
+    ts->host_start_ns = host_ns;
+    ts->window_min = INT64_MAX;
+    return;
+  }
+
+  // Unwrap the device counter. If reports stopped for longer than one
+  // counter period, use the host clock to guess the number of wraps.
+  uint64_t delta = (raw - ts->last_raw) & type->timestamp_mask;
+  uint64_t expected = (host_ns - ts->last_host_ns) * type->timestamp_ns_den /
+                      type->timestamp_ns_num;
+  if (expected > wrap / 2 && expected > delta)
+    delta += (expected - delta + wrap / 2) / wrap * wrap;
+  ts->ticks += delta;
+  ts->last_raw = raw;
+  ts->last_host_ns = host_ns;
+
+  ts->device_ns = ts->ticks * type->timestamp_ns_num / type->timestamp_ns_den;
+  int64_t host_rel = host_ns - ts->host_start_ns;
+  int64_t raw_offset = host_rel - ts->device_ns;
+
+  // Queuing delay against the predicted arrival time. A negative delay
+  // means our offset is too high.
+  int64_t predicted = ts->device_ns + ts->device_ns / 1000 * ts->drift_ppb / 1000000 + ts->offset_ns;
+  ts->delay_ns = host_rel - predicted;
+  if (ts->delay_ns < 0) {
+    ts->offset_ns += ts->delay_ns;
+    ts->delay_ns = 0;
+  }
+
+  ts->samples++;
+  ts->delay_sum_ns += ts->delay_ns;
+  if (ts->delay_ns > ts->delay_max_ns)
+    ts->delay_max_ns = ts->delay_ns;
+
+  // Drift is the slope between the minimum offsets of two windows
+  if (raw_offset < ts->window_min) {
+    ts->window_min = raw_offset;
+    ts->window_min_dev = ts->device_ns;
+  }
+  if (++ts->window_count < TIMESYNC_WINDOW)
+    return;
+
+  if (ts->have_last_min && ts->window_min_dev > ts->last_min_dev) {
+    int64_t slope = (ts->window_min - ts->last_min) * 1000000 /
+                    ((ts->window_min_dev - ts->last_min_dev) / 1000);
+    ts->drift_ppb = ts->have_drift ? (ts->drift_ppb * 3 + slope) / 4 : slope;
+    ts->have_drift = 1;
+    ts->offset_ns = ts->window_min - ts->window_min_dev / 1000 * ts->drift_ppb / 1000000;
+  }
+  ts->have_last_min = 1;
+  ts->last_min = ts->window_min;
+  ts->last_min_dev = ts->window_min_dev;
+  ts->window_min = INT64_MAX;
+  ts->window_count = 0;
+}
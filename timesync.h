@@ -0,0 +1,50 @@
+/*
+  pspaddrv - Usermode Playstation 3/4 to XBox 360 gamepad driver
+  Copyright (C) 2016  Manuel Reimer <manuel.reimer@gmx.de>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Relates the sample clock of a controller to CLOCK_MONOTONIC. The host
+// time of a report is modeled as device time scaled by the clock drift
+// plus a constant offset plus the (never negative) USB/host queuing delay.
+struct TimeSync {
+  int started;
+  uint32_t last_raw;            // Last raw counter value from the device
+  uint64_t ticks;               // Unwrapped device counter
+  int64_t last_host_ns;
+  int64_t host_start_ns;
+
+  int64_t device_ns;            // Device time since the first sample
+  int64_t offset_ns;            // Lower envelope of host - device time
+  int64_t drift_ppb;            // Device clock drift against host clock
+  int64_t delay_ns;             // Queuing delay of the last sample
+
+  // Minimum of host - device time per window, used to estimate drift
+  int window_count;
+  int64_t window_min;
+  int64_t window_min_dev;
+  int have_last_min;
+  int have_drift;
+  int64_t last_min;
+  int64_t last_min_dev;
+
+  // Delay statistics
+  uint64_t samples;
+  int64_t delay_sum_ns;
+  int64_t delay_max_ns;
+};
+
+void TimeSyncUpdate(struct TimeSync *ts, const struct DeviceType *type,
+                    uint32_t raw, const struct timespec *host);
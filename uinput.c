@@ -22,130 +22,275 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include "uinput.h"
+#include "orientation.h"
 
-// Creates new event device and initializes it with all the properties of the
-// XBox 360 USB gamepad.
-int UinputInit() {
-  int fd;
-  if ((fd = open("/dev/uinput", O_RDWR)) == -1) {
-    syslog(LOG_ERR, "Failed to open /dev/uinput!");
-    return -1;
+#define XPAD_STICK_AXIS(c) {c, XPAD_STICKMIN, XPAD_STICKMAX, XPAD_FUZZ, XPAD_FLAT}
+#define RAW_STICK_AXIS(c)  {c, 0, PS_STICKMAX, 0, 0}
+#define HAT_AXIS(c)        {c, -1, 1, 0, 0}
+
+static const struct UinputProfile profiles[] = {
+  {
+    .key = "xbox360",
+    .name = "Microsoft X-Box 360 pad",
+    .vendor = 0x045e, .product = 0x028e, .version = 0x110,
+    .buttons = {BTN_A, BTN_B, BTN_X, BTN_Y, BTN_SELECT, BTN_START, BTN_MODE,
+                BTN_THUMBL, BTN_TL, BTN_THUMBR, BTN_TR},
+    .axes = {
+      XPAD_STICK_AXIS(ABS_X), XPAD_STICK_AXIS(ABS_Y),
+      XPAD_STICK_AXIS(ABS_RX), XPAD_STICK_AXIS(ABS_RY),
+      {ABS_Z, 0, XPAD_TRIGGERMAX, 0, 0}, {ABS_RZ, 0, XPAD_TRIGGERMAX, 0, 0},
+      HAT_AXIS(ABS_HAT0X), HAT_AXIS(ABS_HAT0Y)
+    }
+  },
+  {
+    .key = "xboxone",
+    .name = "Microsoft X-Box One pad",
+    .vendor = 0x045e, .product = 0x02d1, .version = 0x100,
+    .buttons = {BTN_A, BTN_B, BTN_X, BTN_Y, BTN_SELECT, BTN_START, BTN_MODE,
+                BTN_THUMBL, BTN_TL, BTN_THUMBR, BTN_TR},
+    .axes = {
+      XPAD_STICK_AXIS(ABS_X), XPAD_STICK_AXIS(ABS_Y),
+      XPAD_STICK_AXIS(ABS_RX), XPAD_STICK_AXIS(ABS_RY),
+      {ABS_Z, 0, 1023, 0, 0}, {ABS_RZ, 0, 1023, 0, 0},
+      HAT_AXIS(ABS_HAT0X), HAT_AXIS(ABS_HAT0Y)
+    },
+    .trigger_shift = 2
+  },
+  {
+    // Layout of the kernel driver for the DualShock 4
+    .key = "ds4",
+    .name = "Sony Computer Entertainment Wireless Controller",
+    .vendor = 0x054c, .product = 0x05c4, .version = 0x8111,
+    .buttons = {BTN_SOUTH, BTN_EAST, BTN_WEST, BTN_NORTH, BTN_SELECT, BTN_START, BTN_MODE,
+                BTN_THUMBL, BTN_TL, BTN_THUMBR, BTN_TR},
+    .axes = {
+      RAW_STICK_AXIS(ABS_X), RAW_STICK_AXIS(ABS_Y),
+      RAW_STICK_AXIS(ABS_RX), RAW_STICK_AXIS(ABS_RY),
+      {ABS_Z, 0, 255, 0, 0}, {ABS_RZ, 0, 255, 0, 0},
+      HAT_AXIS(ABS_HAT0X), HAT_AXIS(ABS_HAT0Y)
+    },
+    .raw_sticks = 1
   }
+};
 
-  int i;
+#define PROFILES (sizeof(profiles) / sizeof(profiles[0]))
 
-  // Set evbits
-  int evbits[] = {EV_ABS, EV_KEY, EV_SYN};
-  for (i = 0; i < sizeof(evbits)/sizeof(int); i++) {
-    if (ioctl(fd, UI_SET_EVBIT, evbits[i]) < 0) {
-      syslog(LOG_ERR, "uinput ioctl failed!");
-      close(fd);
-      return -1;
-    }
+// Capability ioctls of a profile, expanded once at startup
+#define UINPUT_MAX_CAPS 64
+struct UinputCaps {
+  int count;
+  struct {
+    unsigned long request;
+    int value;
+  } ops[UINPUT_MAX_CAPS];
+};
+
+static struct UinputCaps profile_caps[PROFILES];
+
+// Device creation times per profile
+static struct {
+  uint64_t count;
+  int64_t sum_ns;
+  int64_t max_ns;
+} profile_stats[PROFILES];
+
+static void UinputCapsAdd(struct UinputCaps *caps, unsigned long request, int value) {
+  if (caps->count < UINPUT_MAX_CAPS) {
+    caps->ops[caps->count].request = request;
+    caps->ops[caps->count].value = value;
+    caps->count++;
   }
+}
 
-  // Set keybits
-  int keybits[] = {BTN_A, BTN_B, BTN_X, BTN_Y,
-                   BTN_SELECT, BTN_START, BTN_MODE,
-                   BTN_THUMBL, BTN_TL, BTN_THUMBR, BTN_TR};
-  for (i = 0; i < sizeof(keybits)/sizeof(int); i++) {
-    if (ioctl(fd, UI_SET_KEYBIT, keybits[i]) < 0) {
-      syslog(LOG_ERR, "uinput ioctl failed!");
-      close(fd);
-      return -1;
+// Expands the capabilities of all profiles. Call once before creating
+// devices.
+void UinputProfilesInit() {
+  int i, j;
+
+  for (i = 0; i < PROFILES; i++) {
+    struct UinputCaps *caps = &profile_caps[i];
+    caps->count = 0;
+    UinputCapsAdd(caps, UI_SET_EVBIT, EV_SYN);
+    UinputCapsAdd(caps, UI_SET_EVBIT, EV_KEY);
+    UinputCapsAdd(caps, UI_SET_EVBIT, EV_ABS);
+
+    // Device sample time is sent with every frame
+    UinputCapsAdd(caps, UI_SET_EVBIT, EV_MSC);
+    UinputCapsAdd(caps, UI_SET_MSCBIT, MSC_TIMESTAMP);
+
+    UinputCapsAdd(caps, UI_SET_EVBIT, EV_FF);
+    UinputCapsAdd(caps, UI_SET_FFBIT, FF_RUMBLE);
+
+    for (j = 0; j < XPAD_BUTTONS; j++) {
+      if (profiles[i].buttons[j])
+        UinputCapsAdd(caps, UI_SET_KEYBIT, profiles[i].buttons[j]);
     }
+    for (j = 0; j < UINPUT_SOURCES; j++)
+      UinputCapsAdd(caps, UI_SET_ABSBIT, profiles[i].axes[j].code);
   }
+}
 
-  // Set absbits
-  int absbits[] = {ABS_HAT0X, ABS_HAT0Y,
-                   ABS_X, ABS_Y, ABS_Z,
-                   ABS_RX, ABS_RY, ABS_RZ};
-  for (i = 0; i < sizeof(absbits)/sizeof(int); i++) {
-    if (ioctl(fd, UI_SET_ABSBIT, absbits[i]) < 0) {
-      syslog(LOG_ERR, "uinput ioctl failed!");
-      close(fd);
-      return -1;
-    }
+// Returns the profile called "key". NULL gets the default profile.
+const struct UinputProfile *UinputProfileLookup(const char *key) {
+  int i;
+
+  if (key == NULL)
+    return &profiles[0];
+  for (i = 0; i < PROFILES; i++) {
+    if (strcmp(profiles[i].key, key) == 0)
+      return &profiles[i];
   }
+  return NULL;
+}
 
-  // Set force feedback bits
-  if (1) { // TODO: Make this configurable
-    if (ioctl(fd, UI_SET_EVBIT, EV_FF) < 0) {
-      syslog(LOG_ERR, "uinput ioctl failed!");
+// Writes device creation times to syslog
+void UinputProfilesReport() {
+  int i;
+
+  for (i = 0; i < PROFILES; i++) {
+    uint64_t count = __atomic_load_n(&profile_stats[i].count, __ATOMIC_RELAXED);
+    if (count)
+      syslog(LOG_INFO, "Profile %s: %llu devices created, avg %lld us, max %lld us",
+             profiles[i].key, (unsigned long long)count,
+             (long long)(__atomic_load_n(&profile_stats[i].sum_ns, __ATOMIC_RELAXED) / count / 1000),
+             (long long)(__atomic_load_n(&profile_stats[i].max_ns, __ATOMIC_RELAXED) / 1000));
+  }
+}
+
+static int64_t UinputNowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Sets up an opened uinput device with UI_DEV_SETUP and UI_ABS_SETUP and
+// creates it. Closes "fd" on error.
+static int UinputCreate(int fd, const struct uinput_setup *setup,
+                        const struct UinputAxis *axes, int count) {
+  int i;
+
+  if (ioctl(fd, UI_DEV_SETUP, setup) < 0) {
+    syslog(LOG_ERR, "uinput device setup failed!");
+    close(fd);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    struct uinput_abs_setup abs;
+    memset(&abs, 0, sizeof(abs));
+    abs.code = axes[i].code;
+    abs.absinfo.minimum = axes[i].min;
+    abs.absinfo.maximum = axes[i].max;
+    abs.absinfo.fuzz = axes[i].fuzz;
+    abs.absinfo.flat = axes[i].flat;
+    if (ioctl(fd, UI_ABS_SETUP, &abs) < 0) {
+      syslog(LOG_ERR, "uinput abs setup failed!");
       close(fd);
       return -1;
     }
-    if (ioctl(fd, UI_SET_FFBIT, FF_RUMBLE) < 0) {
+  }
+
+  if (ioctl(fd, UI_DEV_CREATE) < 0) {
+    syslog(LOG_ERR, "uinput device creation failed!");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Creates new event device as described by "profile"
+int UinputInit(const struct UinputProfile *profile) {
+  int64_t start = UinputNowNs();
+  int index = profile - profiles;
+  const struct UinputCaps *caps = &profile_caps[index];
+
+  int fd;
+  if ((fd = open("/dev/uinput", O_RDWR)) == -1) {
+    syslog(LOG_ERR, "Failed to open /dev/uinput!");
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < caps->count; i++) {
+    if (ioctl(fd, caps->ops[i].request, caps->ops[i].value) < 0) {
       syslog(LOG_ERR, "uinput ioctl failed!");
       close(fd);
       return -1;
     }
   }
 
-  // Set up uinput device information
-  struct uinput_user_dev uidev;
-  memset(&uidev, 0, sizeof(uidev));
-
-  snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "Microsoft X-Box 360 pad");
-  uidev.id.bustype = BUS_USB;
-  uidev.id.vendor  = 0x045e;
-  uidev.id.product = 0x028e;
-  uidev.id.version = 0x110;
-
-  uidev.absmin[ABS_X] = XPAD_STICKMIN;
-  uidev.absmax[ABS_X] = XPAD_STICKMAX;
-  uidev.absfuzz[ABS_X] = XPAD_FUZZ;
-  uidev.absflat[ABS_X] = XPAD_FLAT;
-  uidev.absmin[ABS_Y] = XPAD_STICKMIN;
-  uidev.absmax[ABS_Y] = XPAD_STICKMAX;
-  uidev.absfuzz[ABS_Y] = XPAD_FUZZ;
-  uidev.absflat[ABS_Y] = XPAD_FLAT;
-
-  uidev.absmin[ABS_RX] = XPAD_STICKMIN;
-  uidev.absmax[ABS_RX] = XPAD_STICKMAX;
-  uidev.absfuzz[ABS_RX] = XPAD_FUZZ;
-  uidev.absflat[ABS_RX] = XPAD_FLAT;
-  uidev.absmin[ABS_RY] = XPAD_STICKMIN;
-  uidev.absmax[ABS_RY] = XPAD_STICKMAX;
-  uidev.absfuzz[ABS_RY] = XPAD_FUZZ;
-  uidev.absflat[ABS_RY] = XPAD_FLAT;
-
-  uidev.absmin[ABS_Z] = 0;
-  uidev.absmax[ABS_Z] = XPAD_TRIGGERMAX;
-  uidev.absfuzz[ABS_Z] = 0;
-  uidev.absflat[ABS_Z] = 0;
-  uidev.absmin[ABS_RZ] = 0;
-  uidev.absmax[ABS_RZ] = XPAD_TRIGGERMAX;
-  uidev.absfuzz[ABS_RZ] = 0;
-  uidev.absflat[ABS_RZ] = 0;
-
-  uidev.absmin[ABS_HAT0X] = -1;
-  uidev.absmax[ABS_HAT0X] = 1;
-  uidev.absfuzz[ABS_HAT0X] = 0;
-  uidev.absflat[ABS_HAT0X] = 0;
-  uidev.absmin[ABS_HAT0Y] = -1;
-  uidev.absmax[ABS_HAT0Y] = 1;
-  uidev.absfuzz[ABS_HAT0Y] = 0;
-  uidev.absflat[ABS_HAT0Y] = 0;
-
-  if (1) // TODO: Make this configurable
-    uidev.ff_effects_max = 1;
-
-  if (write(fd, &uidev, sizeof(uidev)) < 0) {
-    syslog(LOG_ERR, "uinput write failed!");
-    close(fd);
+  struct uinput_setup setup;
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "%s", profile->name);
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor  = profile->vendor;
+  setup.id.product = profile->product;
+  setup.id.version = profile->version;
+  setup.ff_effects_max = 1;
+
+  fd = UinputCreate(fd, &setup, profile->axes, UINPUT_SOURCES);
+  if (fd < 0)
+    return -1;
+
+  int64_t took = UinputNowNs() - start;
+  int64_t max = __atomic_load_n(&profile_stats[index].max_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&profile_stats[index].count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&profile_stats[index].sum_ns, took, __ATOMIC_RELAXED);
+  while (took > max &&
+         !__atomic_compare_exchange_n(&profile_stats[index].max_ns, &max, took, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  syslog(LOG_DEBUG, "Created %s in %lld us", profile->name, (long long)(took / 1000));
+
+  return fd;
+}
+
+// Creates the companion event device which carries the orientation of a
+// controller. ABS_X/Y/Z hold the gravity removed acceleration,
+// ABS_RX/RY/RZ and ABS_MISC the quaternion (x, y, z, w).
+int UinputInitMotion(const struct UinputProfile *profile) {
+  static const struct UinputAxis axes[] = {
+    {ABS_X, -MOTION_ACCLMAX, MOTION_ACCLMAX, 0, 0},
+    {ABS_Y, -MOTION_ACCLMAX, MOTION_ACCLMAX, 0, 0},
+    {ABS_Z, -MOTION_ACCLMAX, MOTION_ACCLMAX, 0, 0},
+    {ABS_RX, -MOTION_QUATMAX, MOTION_QUATMAX, 0, 0},
+    {ABS_RY, -MOTION_QUATMAX, MOTION_QUATMAX, 0, 0},
+    {ABS_RZ, -MOTION_QUATMAX, MOTION_QUATMAX, 0, 0},
+    {ABS_MISC, -MOTION_QUATMAX, MOTION_QUATMAX, 0, 0}
+  };
+  int fd;
+  if ((fd = open("/dev/uinput", O_RDWR)) == -1) {
+    syslog(LOG_ERR, "Failed to open /dev/uinput!");
     return -1;
   }
-  if (ioctl(fd, UI_DEV_CREATE) < 0) {
-    syslog(LOG_ERR, "uinput device creation failed!");
+
+  int i;
+  if (ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0 ||
+      ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_ACCELEROMETER) < 0) {
+    syslog(LOG_ERR, "uinput ioctl failed!");
     close(fd);
     return -1;
   }
+  for (i = 0; i < sizeof(axes)/sizeof(axes[0]); i++) {
+    if (ioctl(fd, UI_SET_ABSBIT, axes[i].code) < 0) {
+      syslog(LOG_ERR, "uinput ioctl failed!");
+      close(fd);
+      return -1;
+    }
+  }
 
-  return fd;
-}
+  struct uinput_setup setup;
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "%s Motion Sensors", profile->name);
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor  = profile->vendor;
+  setup.id.product = profile->product;
+  setup.id.version = profile->version;
 
+  return UinputCreate(fd, &setup, axes, sizeof(axes)/sizeof(axes[0]));
+}
 
 int TranslateStickValue(int value) {
   value -= 128;
@@ -164,75 +309,79 @@ int TranslateStickValue(int value) {
 }
 
 
-// This function sends one group of messages out to the event device
+static inline void UinputFrameAdd(struct UinputFrame *frame, int type, int code, int value) {
+  struct input_event *event = &frame->events[frame->count++];
+  event->type = type;
+  event->code = code;
+  event->value = value;
+}
+
+void UinputFrameInit(struct UinputFrame *frame) {
+  frame->count = 0;
+}
+
+// Adds the time a frame was sampled on the device in microseconds
+void UinputFrameAddTimestamp(struct UinputFrame *frame, unsigned int usec) {
+  UinputFrameAdd(frame, EV_MSC, MSC_TIMESTAMP, usec);
+}
+
+// Adds the full controller state to a frame
 // Stick values have to be passed in the PlayStation range (0 to 255) and are
-// translated before sending to the kernel.
-void UinputSendXpadMsg(int fd, struct XpadMsg msg) {
-  struct input_event event;
-  event.type = EV_KEY;
-  event.code = BTN_A;
-  event.value = msg.btn_a;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_B;
-  event.value = msg.btn_b;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_X;
-  event.value = msg.btn_x;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_Y;
-  event.value = msg.btn_y;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_SELECT;
-  event.value = msg.btn_select;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_START;
-  event.value = msg.btn_start;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_MODE;
-  event.value = msg.btn_guide;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_THUMBL;
-  event.value = msg.btn_ls;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_THUMBR;
-  event.value = msg.btn_rs;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_TL;
-  event.value = msg.btn_lb;
-  write(fd, &event, sizeof(event));
-  event.code = BTN_TR;
-  event.value = msg.btn_rb;
-  write(fd, &event, sizeof(event));
-
-  event.type = EV_ABS;
-  event.code = ABS_HAT0X;
-  event.value = msg.abs_dx;
-  write(fd, &event, sizeof(event));
-  event.code = ABS_HAT0Y;
-  event.value = msg.abs_dy;
-  write(fd, &event, sizeof(event));
-  event.code = ABS_Z;
-  event.value = msg.abs_lt;
-  write(fd, &event, sizeof(event));
-  event.code = ABS_RZ;
-  event.value = msg.abs_rt;
-  write(fd, &event, sizeof(event));
-
-  event.code = ABS_X;
-  event.value = TranslateStickValue(msg.abs_lx);
-  write(fd, &event, sizeof(event));
-  event.code = ABS_Y;
-  event.value = TranslateStickValue(msg.abs_ly);
-  write(fd, &event, sizeof(event));
-  event.code = ABS_RX;
-  event.value = TranslateStickValue(msg.abs_rx);
-  write(fd, &event, sizeof(event));
-  event.code = ABS_RY;
-  event.value = TranslateStickValue(msg.abs_ry);
-  write(fd, &event, sizeof(event));
-
-  event.type = EV_SYN;
-  event.code = 0;
-  event.value = 0;
-  write(fd, &event, sizeof(event));
+// translated before sending to the kernel, unless the profile wants them raw.
+void UinputFrameAddXpadMsg(struct UinputFrame *frame, const struct UinputProfile *profile,
+                           const struct XpadMsg *msg) {
+  const struct UinputAxis *axes = profile->axes;
+  int i;
+  for (i = 0; i < XPAD_BUTTONS; i++) {
+    if (profile->buttons[i])
+      UinputFrameAdd(frame, EV_KEY, profile->buttons[i], (msg->buttons >> i) & 1);
+  }
+
+  UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_DX].code, msg->abs_dx);
+  UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_DY].code, msg->abs_dy);
+  UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_LT].code, msg->abs_lt << profile->trigger_shift);
+  UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_RT].code, msg->abs_rt << profile->trigger_shift);
+
+  if (profile->raw_sticks) {
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_LX].code, msg->abs_lx);
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_LY].code, msg->abs_ly);
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_RX].code, msg->abs_rx);
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_RY].code, msg->abs_ry);
+  }
+  else {
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_LX].code, TranslateStickValue(msg->abs_lx));
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_LY].code, TranslateStickValue(msg->abs_ly));
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_RX].code, TranslateStickValue(msg->abs_rx));
+    UinputFrameAdd(frame, EV_ABS, axes[UINPUT_SRC_RY].code, TranslateStickValue(msg->abs_ry));
+  }
+}
+
+// Terminates the frame with SYN_REPORT and hands all events to the kernel
+// with one single write
+int UinputFrameSend(int fd, struct UinputFrame *frame) {
+  UinputFrameAdd(frame, EV_SYN, SYN_REPORT, 0);
+  ssize_t n = write(fd, frame->events, frame->count * sizeof(struct input_event));
+  frame->count = 0;
+  return n < 0 ? -1 : 0;
+}
+
+// Sends the full controller state as one frame
+void UinputSendXpadMsg(int fd, const struct UinputProfile *profile, const struct XpadMsg *msg) {
+  struct UinputFrame frame;
+  UinputFrameInit(&frame);
+  UinputFrameAddXpadMsg(&frame, profile, msg);
+  UinputFrameSend(fd, &frame);
+}
+
+// Sends the current state of an orientation filter to the motion device
+void UinputSendMotionMsg(int fd, const struct Orientation *o) {
+  struct UinputFrame frame;
+  int i;
+  UinputFrameInit(&frame);
+  for (i = 0; i < 3; i++)
+    UinputFrameAdd(&frame, EV_ABS, ABS_X + i, o->linear[i]);
+  for (i = 0; i < 3; i++)
+    UinputFrameAdd(&frame, EV_ABS, ABS_RX + i, o->q[i + 1] >> 16);
+  UinputFrameAdd(&frame, EV_ABS, ABS_MISC, o->q[0] >> 16);
+  UinputFrameSend(fd, &frame);
 }
@@ -16,33 +16,45 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-struct XpadMsg {
-  unsigned int btn_a;
-  unsigned int btn_b;
-  unsigned int btn_x;
-  unsigned int btn_y;
+#include <stdint.h>
+#include <linux/input.h>
+
+// Bits in XpadMsg.buttons
+#define XPAD_BTN_A        (1 << 0)
+#define XPAD_BTN_B        (1 << 1)
+#define XPAD_BTN_X        (1 << 2)
+#define XPAD_BTN_Y        (1 << 3)
+#define XPAD_BTN_SELECT   (1 << 4)
+#define XPAD_BTN_START    (1 << 5)
+#define XPAD_BTN_GUIDE    (1 << 6)
+#define XPAD_BTN_LS       (1 << 7)
+#define XPAD_BTN_LB       (1 << 8)
+#define XPAD_BTN_RS       (1 << 9)
+#define XPAD_BTN_RB       (1 << 10)
+#define XPAD_BUTTONS      11
 
-  unsigned int btn_select;
-  unsigned int btn_start;
-  unsigned int btn_guide;
+// Controller state. Small enough to be compared or copied as two words.
+struct XpadMsg {
+  uint32_t buttons;
 
-  unsigned int btn_ls;
-  unsigned int btn_lb;
+  int16_t abs_lx;  // Sticks in PlayStation range (0 to 255)
+  int16_t abs_ly;
+  int16_t abs_rx;
+  int16_t abs_ry;
 
-  unsigned int btn_rs;
-  unsigned int btn_rb;
+  uint8_t abs_lt;
+  uint8_t abs_rt;
 
-  signed int abs_lx;
-  signed int abs_ly;
-  signed int abs_rx;
-  signed int abs_ry;
+  int8_t abs_dx;
+  int8_t abs_dy;
+} __attribute__((aligned(16)));
 
-  unsigned int abs_lt;
-  unsigned int abs_rt;
+// Nonzero if buttons or d-pad differ
+static inline uint32_t XpadButtonsChanged(const struct XpadMsg *a, const struct XpadMsg *b) {
+  return (a->buttons ^ b->buttons) |
+         (uint8_t)(a->abs_dx ^ b->abs_dx) | (uint8_t)(a->abs_dy ^ b->abs_dy);
+}
 
-  signed int abs_dx;
-  signed int abs_dy;
-};
 
 #define XPAD_TRIGGERMAX 255
 #define XPAD_STICKMIN -32768
@@ -53,5 +65,56 @@ struct XpadMsg {
 #define PS_FLAT 15
 #define PS_STICKMAX 255
 
-int UinputInit();
-void UinputSendXpadMsg(int fd, struct XpadMsg msg);
+#define MOTION_ACCLMAX (4 << 14)  // 4 g in ORIENTATION_G units
+#define MOTION_QUATMAX (1 << 14)
+
+// One frame (events up to SYN_REPORT), written to uinput with one syscall
+#define UINPUT_FRAME_MAX 32
+struct UinputFrame {
+  int count;
+  struct input_event events[UINPUT_FRAME_MAX];
+};
+
+// Where the value of a virtual device axis comes from
+#define UINPUT_SRC_LX  0
+#define UINPUT_SRC_LY  1
+#define UINPUT_SRC_RX  2
+#define UINPUT_SRC_RY  3
+#define UINPUT_SRC_LT  4
+#define UINPUT_SRC_RT  5
+#define UINPUT_SRC_DX  6
+#define UINPUT_SRC_DY  7
+#define UINPUT_SOURCES 8
+
+struct UinputAxis {
+  int code;
+  int min, max, fuzz, flat;
+};
+
+// Describes the virtual device one controller shows up as
+struct UinputProfile {
+  const char *key;                  // Name for the command line
+  const char *name;
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t version;
+  int buttons[XPAD_BUTTONS];        // Key code for each XPAD_BTN_* bit
+  struct UinputAxis axes[UINPUT_SOURCES];
+  int raw_sticks;                   // Sticks in PlayStation range, untranslated
+  int trigger_shift;                // Triggers are scaled up by this many bits
+};
+
+struct Orientation;
+
+void UinputProfilesInit();
+const struct UinputProfile *UinputProfileLookup(const char *key);
+void UinputProfilesReport();
+int UinputInit(const struct UinputProfile *profile);
+int UinputInitMotion(const struct UinputProfile *profile);
+void UinputFrameInit(struct UinputFrame *frame);
+void UinputFrameAddTimestamp(struct UinputFrame *frame, unsigned int usec);
+void UinputFrameAddXpadMsg(struct UinputFrame *frame, const struct UinputProfile *profile,
+                           const struct XpadMsg *msg);
+int UinputFrameSend(int fd, struct UinputFrame *frame);
+void UinputSendXpadMsg(int fd, const struct UinputProfile *profile, const struct XpadMsg *msg);
+void UinputSendMotionMsg(int fd, const struct Orientation *o);
@@ -16,7 +16,30 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
 #include "usb.h"
+#include "uinput.h"
+#include "device-types.h"
+
+// All USB transfers of the controller code go through this file, so it is
+// the only user of libusb. The test harnesses link it against an emulated
+// libusb (test/fake-libusb.c).
+
+// Sets up the default libusb context
+int USBInit() {
+  return libusb_init(NULL);
+}
+
+void USBExit() {
+  libusb_exit(NULL);
+}
+
+// Name of a libusb error code, for logging
+const char *USBErrorName(int error) {
+  return libusb_error_name(error);
+}
 
 // This function opens an USB device based on a USBDeviceHandlerArgs struct
 // It also handles detaching the kernel driver and claiming the interface
@@ -51,3 +74,260 @@ int USBOpenDevice(struct USBDeviceHandlerArgs* args, libusb_device_handle** hand
   libusb_free_device_list(devs, 1);
   return ret;
 }
+
+// Releases a device opened with USBOpenDevice
+void USBCloseDevice(libusb_device_handle *usbdev) {
+  libusb_close(usbdev);
+}
+
+// Reads one input report from the interrupt IN endpoint of a controller
+int USBReadReport(libusb_device_handle *usbdev, const struct DeviceType *type,
+                  unsigned char *report, int *transferred, int timeout) {
+  return libusb_interrupt_transfer(usbdev, type->endpoint_in,
+                                   report, type->report_size,
+                                   transferred, timeout);
+}
+
+// Clears a halted endpoint
+int USBClearHalt(libusb_device_handle *usbdev, unsigned char endpoint) {
+  return libusb_clear_halt(usbdev, endpoint);
+}
+
+// Resets the device and takes the interface back from the kernel. Fails if
+// the device had to be enumerated again.
+int USBResetDevice(libusb_device_handle *usbdev) {
+  int ret = libusb_reset_device(usbdev);
+  if (ret < 0)
+    return ret;
+
+  libusb_detach_kernel_driver(usbdev, 0);
+  libusb_claim_interface(usbdev, 0);
+  return 0;
+}
+
+// Reads the HID report descriptor of interface 0
+int USBGetReportDescriptor(libusb_device_handle *usbdev, unsigned char *data, int length) {
+  return libusb_control_transfer(usbdev,
+                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE,
+                        LIBUSB_REQUEST_GET_DESCRIPTOR,
+                        (HID_DT_REPORT<<8),
+                        0,
+                        data,
+                        length,
+                        USB_CTRL_GET_TIMEOUT);
+}
+
+// HID GET_REPORT on the control pipe
+int USBGetReport(libusb_device_handle *usbdev, int type, int id,
+                 unsigned char *data, int length) {
+  return libusb_control_transfer(usbdev,
+                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                        HID_REQ_GET_REPORT,
+                        (type<<8)|id,
+                        0,
+                        data,
+                        length,
+                        USB_CTRL_GET_TIMEOUT);
+}
+
+// HID SET_REPORT on the control pipe
+int USBSetReport(libusb_device_handle *usbdev, int type, int id,
+                 unsigned char *data, int length) {
+  return libusb_control_transfer(usbdev,
+                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                        HID_REQ_SET_REPORT,
+                        (type<<8)|id,
+                        0,
+                        data,
+                        length,
+                        USB_CTRL_GET_TIMEOUT);
+}
+
+static int64_t USBNowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void USBOutputAccount(struct USBOutput *out, int path, int64_t start_ns, int ok) {
+  if (!ok) {
+    __atomic_store_n(&out->failed[path], out->failed[path] + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  int64_t latency = USBNowNs() - start_ns;
+  __atomic_store_n(&out->sent[path], out->sent[path] + 1, __ATOMIC_RELAXED);
+  out->latency_sum_ns[path] += latency;
+  if (latency > out->latency_max_ns[path])
+    out->latency_max_ns[path] = latency;
+}
+
+// Checks if interface 0 of the device has the given interrupt OUT endpoint
+static int USBHasInterruptOut(libusb_device_handle *usbdev, unsigned char endpoint) {
+  struct libusb_config_descriptor *config;
+  int found = 0;
+  int i;
+
+  if (libusb_get_active_config_descriptor(libusb_get_device(usbdev), &config) < 0)
+    return 0;
+
+  if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+    const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+    for (i = 0; i < intf->bNumEndpoints; i++) {
+      const struct libusb_endpoint_descriptor *ep = &intf->endpoint[i];
+      if (ep->bEndpointAddress == endpoint &&
+          (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        found = 1;
+    }
+  }
+
+  libusb_free_config_descriptor(config);
+  return found;
+}
+
+// Submits the current template. Caller holds out->lock.
+static int USBOutputSubmit(struct USBOutput *out) {
+  memcpy(out->buffer, out->report, out->length);
+  out->transfer->length = out->length;
+  out->submit_ns = USBNowNs();
+  out->dirty = 0;
+
+  int ret = libusb_submit_transfer(out->transfer);
+  out->busy = (ret == 0);
+  return ret;
+}
+
+// Completion of an output transfer. Called from whichever thread currently
+// handles libusb events, usually the controller's handler thread.
+static void USBOutputCallback(struct libusb_transfer *transfer) {
+  struct USBOutput *out = (struct USBOutput *)transfer->user_data;
+
+  pthread_mutex_lock(&out->lock);
+  out->busy = 0;
+  if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    pthread_mutex_unlock(&out->lock);
+    return;
+  }
+
+  USBOutputAccount(out, 0, out->submit_ns, transfer->status == LIBUSB_TRANSFER_COMPLETED);
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    // Endpoint doesn't work for us. Use control transfers from now on.
+    // The lost report gets sent again by USBOutputFlush, sync transfers
+    // are not allowed in here.
+    syslog(LOG_WARNING, "Output transfer failed (%d), falling back to control transfers",
+           transfer->status);
+    out->endpoint = 0;
+    out->dirty = 0;
+    __atomic_store_n(&out->resend, 1, __ATOMIC_RELAXED);
+  }
+  else if (out->dirty)
+    USBOutputSubmit(out);
+  pthread_mutex_unlock(&out->lock);
+}
+
+// Prepares the output channel. The interrupt OUT endpoint the device type
+// expects is only used if the device really has it.
+void USBOutputInit(struct USBOutput *out, libusb_device_handle *usbdev,
+                   const struct DeviceType *type) {
+  unsigned char endpoint = type->endpoint_out;
+
+  memset(out, 0, sizeof(struct USBOutput));
+  pthread_mutex_init(&out->lock, NULL);
+  out->usbdev = usbdev;
+  out->control_report_id = type->control_report_id;
+
+  if (endpoint && USBHasInterruptOut(usbdev, endpoint)) {
+    out->transfer = libusb_alloc_transfer(0);
+    if (out->transfer) {
+      libusb_fill_interrupt_transfer(out->transfer, usbdev, endpoint, out->buffer, 0,
+                                     USBOutputCallback, out, USB_CTRL_GET_TIMEOUT);
+      out->endpoint = endpoint;
+    }
+  }
+}
+
+// Sends the template over the control pipe. Caller holds out->lock, it is
+// released while the transfer runs.
+static int USBOutputSendControl(struct USBOutput *out) {
+  unsigned char buf[USB_MAX_REPORT_SIZE];
+  int length = out->length;
+
+  __atomic_store_n(&out->resend, 0, __ATOMIC_RELAXED);
+  memcpy(buf, out->report, length);
+  pthread_mutex_unlock(&out->lock);
+
+  // First byte of the template is the report ID. It always goes into
+  // wValue, the payload only keeps it if the device wants it there.
+  int skip = out->control_report_id ? 0 : 1;
+  int64_t start = USBNowNs();
+  int ret = USBSetReport(out->usbdev, HID_OUTPUT_REPORT, buf[0], buf + skip, length - skip);
+  pthread_mutex_lock(&out->lock);
+  USBOutputAccount(out, 1, start, ret >= 0);
+  return ret;
+}
+
+// Sends the report again if its interrupt transfer failed. Has to be called
+// regularly from outside of libusb callbacks.
+void USBOutputFlush(struct USBOutput *out) {
+  if (!__atomic_load_n(&out->resend, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock(&out->lock);
+  if (out->resend)
+    USBOutputSendControl(out);
+  pthread_mutex_unlock(&out->lock);
+}
+
+// Sends the current report template. Over the interrupt endpoint this never
+// blocks: If a transfer is still in flight, the latest template is sent as
+// soon as it completes.
+int USBOutputSend(struct USBOutput *out) {
+  pthread_mutex_lock(&out->lock);
+  if (out->endpoint) {
+    int ret = 0;
+    if (out->busy)
+      out->dirty = 1;
+    else if ((ret = USBOutputSubmit(out)) < 0) {
+      USBOutputAccount(out, 0, 0, 0);
+      out->endpoint = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+    if (ret == 0)
+      return 0;
+    syslog(LOG_WARNING, "Output submit failed (%s), falling back to control transfers",
+           libusb_error_name(ret));
+    pthread_mutex_lock(&out->lock);
+  }
+  int ret = USBOutputSendControl(out);
+  pthread_mutex_unlock(&out->lock);
+  return ret;
+}
+
+// Cancels a transfer still in flight and frees everything. Has to be called
+// before the device handle gets closed.
+void USBOutputClose(struct USBOutput *out) {
+  int waited = 0;
+
+  if (out->transfer) {
+    // The callback of a transfer libusb still owns would use "out", so wait
+    // for it. libusb completes every transfer once it is cancelled or the
+    // device is gone.
+    pthread_mutex_lock(&out->lock);
+    out->dirty = 0;
+    if (out->busy)
+      libusb_cancel_transfer(out->transfer);
+    while (out->busy) {
+      pthread_mutex_unlock(&out->lock);
+      struct timeval tv = {0, 100000};
+      libusb_handle_events_timeout(NULL, &tv);
+      if (++waited == 10)
+        syslog(LOG_WARNING, "Output transfer not cancelled after 1 s, still waiting");
+      pthread_mutex_lock(&out->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    libusb_free_transfer(out->transfer);
+    out->transfer = NULL;
+  }
+
+  pthread_mutex_destroy(&out->lock);
+}
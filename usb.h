@@ -17,6 +17,8 @@
 */
 
 #include <libusb.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #define HID_INPUT_REPORT    0x01
 #define HID_OUTPUT_REPORT   0x02
@@ -25,16 +27,65 @@
 #define HID_REQ_GET_REPORT      0x01
 #define HID_REQ_SET_REPORT      0x09
 
+#define HID_DT_REPORT           0x22
+
 #define USB_CTRL_GET_TIMEOUT    5000 // Timeout for libusb requests
 
-// Constants for "devtype" in "USBDeviceHandlerArgs"
-#define PS3_DEVICE 1
-#define PS4_DEVICE 2
+#define USB_MAX_REPORT_SIZE     64   // Biggest input report of all devices
+
+#define USB_VENDOR_ID_SONY      0x054c
+
+struct DeviceType;
 
 struct USBDeviceHandlerArgs {
   int busnum;
   int devnum;
-  int devtype;
+  const struct DeviceType *type;
+};
+
+// Output channel of a controller. The device module keeps its output report
+// template (starting with the report ID) here and only patches the bytes
+// that change. If the device has an interrupt OUT endpoint, reports are sent
+// asynchronously over it, otherwise with SET_REPORT on the control pipe.
+struct USBOutput {
+  libusb_device_handle *usbdev;
+  unsigned char endpoint;       // 0 = control pipe
+  pthread_mutex_t lock;
+  struct libusb_transfer *transfer;
+  int busy;                     // Transfer in flight
+  int dirty;                    // Template changed while busy
+  int resend;                   // Interrupt transfer failed, resend over control
+  int control_report_id;        // Report ID stays in the SET_REPORT payload
+
+  int length;                   // 0 = template not set up yet
+  unsigned char report[USB_MAX_REPORT_SIZE];
+  unsigned char buffer[USB_MAX_REPORT_SIZE];  // Owned by the transfer
+
+  // Completed reports and latency per path (0 = interrupt, 1 = control).
+  // The counters are written under "lock" but read without it.
+  int64_t submit_ns;
+  uint64_t sent[2];
+  uint64_t failed[2];
+  int64_t latency_sum_ns[2];
+  int64_t latency_max_ns[2];
 };
 
+int USBInit();
+void USBExit();
+const char *USBErrorName(int error);
 int USBOpenDevice(struct USBDeviceHandlerArgs* args, libusb_device_handle** handle);
+void USBCloseDevice(libusb_device_handle *usbdev);
+int USBReadReport(libusb_device_handle *usbdev, const struct DeviceType *type,
+                  unsigned char *report, int *transferred, int timeout);
+int USBClearHalt(libusb_device_handle *usbdev, unsigned char endpoint);
+int USBResetDevice(libusb_device_handle *usbdev);
+int USBGetReportDescriptor(libusb_device_handle *usbdev, unsigned char *data, int length);
+int USBGetReport(libusb_device_handle *usbdev, int type, int id,
+                 unsigned char *data, int length);
+int USBSetReport(libusb_device_handle *usbdev, int type, int id,
+                 unsigned char *data, int length);
+void USBOutputInit(struct USBOutput *out, libusb_device_handle *usbdev,
+                   const struct DeviceType *type);
+int USBOutputSend(struct USBOutput *out);
+void USBOutputFlush(struct USBOutput *out);
+void USBOutputClose(struct USBOutput *out);